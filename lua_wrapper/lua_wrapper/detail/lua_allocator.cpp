@@ -0,0 +1,431 @@
+﻿#include "../lua_allocator.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+SHARELIB_BEGIN_NAMESPACE
+
+namespace Internal
+{
+    //同lauxlib中的l_alloc
+    static void * LuaDefaultAlloc(void *, void * ptr, size_t, size_t nsize)
+    {
+        if (nsize == 0)
+        {
+            std::free(ptr);
+            return nullptr;
+        }
+        return std::realloc(ptr, nsize);
+    }
+
+    //按自身大小对齐的内存, nBytes是2的幂
+    static void * LuaSlabAlignedAlloc(size_t nBytes)
+    {
+#ifdef _MSC_VER
+        return ::_aligned_malloc(nBytes, nBytes);
+#else
+        void * p = nullptr;
+        return (::posix_memalign(&p, nBytes, nBytes) == 0) ? p : nullptr;
+#endif
+    }
+
+    static void LuaSlabAlignedFree(void * p)
+    {
+#ifdef _MSC_VER
+        ::_aligned_free(p);
+#else
+        std::free(p);
+#endif
+    }
+}
+
+lua_memory_quota::lua_memory_quota(size_t nLimitBytes, lua_Alloc pfnAlloc, void * pAllocUd)
+    : m_nLimit(nLimitBytes)
+    , m_nUsed(0)
+    , m_nPeak(0)
+    , m_nFailed(0)
+    , m_pfnAlloc(pfnAlloc ? pfnAlloc : Internal::LuaDefaultAlloc)
+    , m_pAllocUd(pfnAlloc ? pAllocUd : nullptr)
+{
+}
+
+void lua_memory_quota::set_limit(size_t nLimitBytes)
+{
+    m_nLimit.store(nLimitBytes, std::memory_order_relaxed);
+}
+
+size_t lua_memory_quota::get_limit() const
+{
+    return m_nLimit.load(std::memory_order_relaxed);
+}
+
+size_t lua_memory_quota::get_used() const
+{
+    return m_nUsed.load(std::memory_order_relaxed);
+}
+
+size_t lua_memory_quota::get_peak() const
+{
+    return m_nPeak.load(std::memory_order_relaxed);
+}
+
+void lua_memory_quota::reset_peak()
+{
+    m_nPeak.store(m_nUsed.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+size_t lua_memory_quota::get_failed_count() const
+{
+    return m_nFailed.load(std::memory_order_relaxed);
+}
+
+void * lua_memory_quota::alloc(void * ud, void * ptr, size_t osize, size_t nsize)
+{
+    lua_memory_quota * pThis = (lua_memory_quota *)ud;
+    //ptr为nullptr时osize是要创建的对象类型, 不是大小
+    const size_t nOldSize = ptr ? osize : 0;
+    if (nsize <= nOldSize)
+    {
+        //释放和缩小不能失败
+        void * pNew = pThis->m_pfnAlloc(pThis->m_pAllocUd, ptr, osize, nsize);
+        if (nsize == 0 || pNew)
+        {
+            pThis->m_nUsed.fetch_sub(nOldSize - nsize, std::memory_order_relaxed);
+        }
+        return pNew;
+    }
+
+    //先占用配额, 超出上限或分配失败时退还
+    const size_t nGrow = nsize - nOldSize;
+    const size_t nUsed = pThis->m_nUsed.fetch_add(nGrow, std::memory_order_relaxed) + nGrow;
+    const size_t nLimit = pThis->m_nLimit.load(std::memory_order_relaxed);
+    if (nLimit != 0 && nUsed > nLimit)
+    {
+        pThis->m_nUsed.fetch_sub(nGrow, std::memory_order_relaxed);
+        pThis->m_nFailed.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    void * pNew = pThis->m_pfnAlloc(pThis->m_pAllocUd, ptr, osize, nsize);
+    if (!pNew)
+    {
+        pThis->m_nUsed.fetch_sub(nGrow, std::memory_order_relaxed);
+        return nullptr;
+    }
+    size_t nPeak = pThis->m_nPeak.load(std::memory_order_relaxed);
+    while (nUsed > nPeak && !pThis->m_nPeak.compare_exchange_weak(nPeak, nUsed, std::memory_order_relaxed))
+    {
+    }
+    return pNew;
+}
+
+//-------------------------------------------------------------
+
+double lua_slab_allocator::stats::fragmentation() const
+{
+    if (m_nSlabBytes == 0)
+    {
+        return 0;
+    }
+    return 1.0 - (double)m_nSmallRequestedBytes / (double)m_nSlabBytes;
+}
+
+lua_slab_allocator::lua_slab_allocator(size_t nSlabBytes)
+    : m_nSlabBytes(nSlabBytes)
+    , m_pSpareSlab(nullptr)
+    , m_nSlabCount(0)
+    , m_nSmallRequestedBytes(0)
+    , m_nLargeBytes(0)
+    , m_nLargeCount(0)
+    , m_pDemoted(nullptr)
+{
+    assert(m_nSlabBytes >= SLAB_HEADER_SIZE + SLAB_MAX_SMALL_SIZE);
+    assert((m_nSlabBytes & (m_nSlabBytes - 1)) == 0);
+    std::memset(m_classes, 0, sizeof(m_classes));
+}
+
+lua_slab_allocator::~lua_slab_allocator()
+{
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; ++i)
+    {
+        while (m_classes[i].m_pFirst)
+        {
+            slab_header * pSlab = m_classes[i].m_pFirst;
+            m_classes[i].m_pFirst = pSlab->m_pNext;
+            Internal::LuaSlabAlignedFree(pSlab);
+        }
+    }
+    if (m_pSpareSlab)
+    {
+        Internal::LuaSlabAlignedFree(m_pSpareSlab);
+    }
+}
+
+lua_slab_allocator::stats lua_slab_allocator::get_stats() const
+{
+    stats result{};
+    result.m_nSlabBytes = m_nSlabCount * m_nSlabBytes;
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; ++i)
+    {
+        result.m_nSmallBlockBytes += m_classes[i].m_nUsedBlocks * (i + 1) * SLAB_GRANULARITY;
+    }
+    result.m_nSmallRequestedBytes = m_nSmallRequestedBytes;
+    result.m_nLargeBytes = m_nLargeBytes;
+    result.m_nLargeCount = m_nLargeCount;
+    return result;
+}
+
+size_t lua_slab_allocator::get_class_count() const
+{
+    return SLAB_CLASS_COUNT;
+}
+
+lua_slab_allocator::class_stats lua_slab_allocator::get_class_stats(size_t index) const
+{
+    assert(index < SLAB_CLASS_COUNT);
+    class_stats result{};
+    if (index < SLAB_CLASS_COUNT)
+    {
+        result.m_nBlockSize = (index + 1) * SLAB_GRANULARITY;
+        result.m_nUsedBlocks = m_classes[index].m_nUsedBlocks;
+        result.m_nTotalBlocks = m_classes[index].m_nTotalBlocks;
+    }
+    return result;
+}
+
+bool lua_slab_allocator::is_slab_full(const slab_header * pSlab) const
+{
+    const size_t nBlockSize = (pSlab->m_nClass + 1) * SLAB_GRANULARITY;
+    return !pSlab->m_pFreeList && ((size_t)((char *)pSlab + m_nSlabBytes - pSlab->m_pBump) < nBlockSize);
+}
+
+void lua_slab_allocator::unlink_slab(slab_header * pSlab)
+{
+    size_class & sc = m_classes[pSlab->m_nClass];
+    (pSlab->m_pPrev ? pSlab->m_pPrev->m_pNext : sc.m_pFirst) = pSlab->m_pNext;
+    (pSlab->m_pNext ? pSlab->m_pNext->m_pPrev : sc.m_pLast) = pSlab->m_pPrev;
+    pSlab->m_pPrev = nullptr;
+    pSlab->m_pNext = nullptr;
+}
+
+void lua_slab_allocator::link_slab_front(slab_header * pSlab)
+{
+    size_class & sc = m_classes[pSlab->m_nClass];
+    pSlab->m_pPrev = nullptr;
+    pSlab->m_pNext = sc.m_pFirst;
+    (sc.m_pFirst ? sc.m_pFirst->m_pPrev : sc.m_pLast) = pSlab;
+    sc.m_pFirst = pSlab;
+}
+
+void lua_slab_allocator::link_slab_back(slab_header * pSlab)
+{
+    size_class & sc = m_classes[pSlab->m_nClass];
+    pSlab->m_pNext = nullptr;
+    pSlab->m_pPrev = sc.m_pLast;
+    (sc.m_pLast ? sc.m_pLast->m_pNext : sc.m_pFirst) = pSlab;
+    sc.m_pLast = pSlab;
+}
+
+lua_slab_allocator::slab_header * lua_slab_allocator::new_slab(size_t index)
+{
+    slab_header * pSlab = m_pSpareSlab;
+    if (pSlab)
+    {
+        m_pSpareSlab = nullptr;
+    }
+    else
+    {
+        pSlab = (slab_header *)Internal::LuaSlabAlignedAlloc(m_nSlabBytes);
+        if (!pSlab)
+        {
+            return nullptr;
+        }
+        ++m_nSlabCount;
+    }
+    pSlab->m_pFreeList = nullptr;
+    pSlab->m_pBump = (char *)pSlab + SLAB_HEADER_SIZE;
+    pSlab->m_nUsedBlocks = 0;
+    pSlab->m_nClass = index;
+    link_slab_front(pSlab);
+    return pSlab;
+}
+
+void lua_slab_allocator::delete_slab(slab_header * pSlab)
+{
+    size_class & sc = m_classes[pSlab->m_nClass];
+    const size_t nBlockSize = (pSlab->m_nClass + 1) * SLAB_GRANULARITY;
+    sc.m_nTotalBlocks -= (size_t)(pSlab->m_pBump - ((char *)pSlab + SLAB_HEADER_SIZE)) / nBlockSize;
+    unlink_slab(pSlab);
+    if (!m_pSpareSlab)
+    {
+        m_pSpareSlab = pSlab;
+    }
+    else
+    {
+        Internal::LuaSlabAlignedFree(pSlab);
+        --m_nSlabCount;
+    }
+}
+
+void * lua_slab_allocator::alloc_small(size_t nSize)
+{
+    const size_t index = class_index(nSize);
+    const size_t nBlockSize = (index + 1) * SLAB_GRANULARITY;
+    size_class & sc = m_classes[index];
+    //有空闲块的slab总在链表前面
+    slab_header * pSlab = sc.m_pFirst;
+    if (!pSlab || is_slab_full(pSlab))
+    {
+        pSlab = new_slab(index);
+        if (!pSlab)
+        {
+            return nullptr;
+        }
+    }
+    void * pBlock = pSlab->m_pFreeList;
+    if (pBlock)
+    {
+        pSlab->m_pFreeList = *(void **)pBlock;
+    }
+    else
+    {
+        pBlock = pSlab->m_pBump;
+        pSlab->m_pBump += nBlockSize;
+        ++sc.m_nTotalBlocks;
+    }
+    ++pSlab->m_nUsedBlocks;
+    if (is_slab_full(pSlab))
+    {
+        unlink_slab(pSlab);
+        link_slab_back(pSlab);
+    }
+    ++sc.m_nUsedBlocks;
+    m_nSmallRequestedBytes += nSize;
+    return pBlock;
+}
+
+void lua_slab_allocator::free_small(void * ptr, size_t nSize)
+{
+    slab_header * pSlab = (slab_header *)((std::uintptr_t)ptr & ~(std::uintptr_t)(m_nSlabBytes - 1));
+    assert(pSlab->m_nClass == class_index(nSize));
+    size_class & sc = m_classes[pSlab->m_nClass];
+    const bool wasFull = is_slab_full(pSlab);
+    *(void **)ptr = pSlab->m_pFreeList;
+    pSlab->m_pFreeList = ptr;
+    --pSlab->m_nUsedBlocks;
+    --sc.m_nUsedBlocks;
+    m_nSmallRequestedBytes -= nSize;
+    if (pSlab->m_nUsedBlocks == 0)
+    {
+        delete_slab(pSlab);
+    }
+    else if (wasFull)
+    {
+        unlink_slab(pSlab);
+        link_slab_front(pSlab);
+    }
+}
+
+void * lua_slab_allocator::realloc_large(void * ptr, size_t osize, size_t nsize)
+{
+    //容量取整, 缩小为小块时块尾至少有8字节可以保存链表指针
+    const size_t nCapacity = (nsize + SLAB_GRANULARITY - 1) / SLAB_GRANULARITY * SLAB_GRANULARITY;
+    void * pNew = std::realloc(ptr, nCapacity);
+    if (pNew)
+    {
+        if (!ptr)
+        {
+            ++m_nLargeCount;
+        }
+        m_nLargeBytes = m_nLargeBytes - osize + nsize;
+    }
+    return pNew;
+}
+
+void lua_slab_allocator::free_block(void * ptr, size_t nSize, bool isSmall)
+{
+    if (isSmall)
+    {
+        free_small(ptr, nSize);
+    }
+    else
+    {
+        std::free(ptr);
+        m_nLargeBytes -= nSize;
+        --m_nLargeCount;
+    }
+}
+
+bool lua_slab_allocator::remove_demoted(void * ptr)
+{
+    void ** ppNext = &m_pDemoted;
+    while (*ppNext)
+    {
+        void * pBlock = *ppNext;
+        void ** ppBlockNext = (void **)((char *)pBlock + SLAB_MAX_SMALL_SIZE);
+        if (pBlock == ptr)
+        {
+            *ppNext = *ppBlockNext;
+            return true;
+        }
+        ppNext = ppBlockNext;
+    }
+    return false;
+}
+
+void * lua_slab_allocator::alloc(void * ud, void * ptr, size_t osize, size_t nsize)
+{
+    lua_slab_allocator * pThis = (lua_slab_allocator *)ud;
+    //ptr为nullptr时osize是要创建的对象类型, 不是大小
+    const size_t nOldSize = ptr ? osize : 0;
+    bool isOldSmall = (nOldSize <= SLAB_MAX_SMALL_SIZE);
+    if (ptr && isOldSmall && pThis->m_pDemoted && pThis->remove_demoted(ptr))
+    {
+        isOldSmall = false;
+    }
+    if (nsize == 0)
+    {
+        if (ptr)
+        {
+            pThis->free_block(ptr, nOldSize, isOldSmall);
+        }
+        return nullptr;
+    }
+
+    const bool isNewSmall = (nsize <= SLAB_MAX_SMALL_SIZE);
+    if (!ptr)
+    {
+        return isNewSmall ? pThis->alloc_small(nsize) : pThis->realloc_large(nullptr, 0, nsize);
+    }
+    if (!isOldSmall && !isNewSmall)
+    {
+        return pThis->realloc_large(ptr, nOldSize, nsize);
+    }
+    if (isOldSmall && isNewSmall && (class_index(nOldSize) == class_index(nsize)))
+    {
+        pThis->m_nSmallRequestedBytes = pThis->m_nSmallRequestedBytes - nOldSize + nsize;
+        return ptr;
+    }
+
+    //跨级别时复制
+    void * pNew = isNewSmall ? pThis->alloc_small(nsize) : pThis->realloc_large(nullptr, 0, nsize);
+    if (pNew)
+    {
+        std::memcpy(pNew, ptr, (nOldSize < nsize) ? nOldSize : nsize);
+        pThis->free_block(ptr, nOldSize, isOldSmall);
+        return pNew;
+    }
+    if (!isOldSmall && isNewSmall)
+    {
+        //lua假定缩小总是成功: 无法分配slab时保留原来的大块, 按缩小后的大小统计
+        *(void **)((char *)ptr + SLAB_MAX_SMALL_SIZE) = pThis->m_pDemoted;
+        pThis->m_pDemoted = ptr;
+        pThis->m_nLargeBytes = pThis->m_nLargeBytes - nOldSize + nsize;
+        return ptr;
+    }
+    return nullptr;
+}
+
+SHARELIB_END_NAMESPACE
@@ -0,0 +1,145 @@
+﻿#include "../lua_async.h"
+
+SHARELIB_BEGIN_NAMESPACE
+
+namespace Internal
+{
+    //异步操作元表在注册表中的key, 取其地址
+    static const char LUA_ASYNC_OPERATION_KEY = 0;
+
+    //index处是否为异步操作的userdata, 包括已经析构的
+    static bool LuaAsyncIsOperation(lua_State * pLua, int index)
+    {
+        if ((::lua_type(pLua, index) != LUA_TUSERDATA) || !::lua_getmetatable(pLua, index))
+        {
+            return false;
+        }
+        ::lua_rawgetp(pLua, LUA_REGISTRYINDEX, &LUA_ASYNC_OPERATION_KEY);
+        const bool isOperation = (::lua_rawequal(pLua, -1, -2) != 0);
+        ::lua_pop(pLua, 2);
+        return isOperation;
+    }
+
+    //析构后uservalue设为true
+    static bool LuaAsyncIsDestroyed(lua_State * pLua, int index)
+    {
+        const bool isDestroyed = (::lua_getuservalue(pLua, index) == LUA_TBOOLEAN);
+        ::lua_pop(pLua, 1);
+        return isDestroyed;
+    }
+
+    //index处是否为未析构的异步操作, 是的话返回对象
+    static LuaAsyncOperation * LuaAsyncToOperation(lua_State * pLua, int index)
+    {
+        if (!LuaAsyncIsOperation(pLua, index) || LuaAsyncIsDestroyed(pLua, index))
+        {
+            return nullptr;
+        }
+        return (LuaAsyncOperation *)::lua_touserdata(pLua, index);
+    }
+
+    static int LuaAsyncOperationGc(lua_State * pLua)
+    {
+        //元表被__metatable保护, 这里仍然检查参数, 防止通过debug库等直接调用
+        LuaAsyncOperation * pOperation = LuaAsyncToOperation(pLua, 1);
+        if (pOperation)
+        {
+            ::lua_pushboolean(pLua, 1);
+            ::lua_setuservalue(pLua, 1);
+            pOperation->~LuaAsyncOperation();
+        }
+        return 0;
+    }
+
+    void * LuaAsyncNewOperation(lua_State * pLua, size_t size)
+    {
+        return ::lua_newuserdata(pLua, size);
+    }
+
+    void LuaAsyncAttachOperation(lua_State * pLua)
+    {
+        if (LUA_TTABLE != ::lua_rawgetp(pLua, LUA_REGISTRYINDEX, &LUA_ASYNC_OPERATION_KEY))
+        {
+            ::lua_pop(pLua, 1);
+            ::lua_createtable(pLua, 0, 2);
+            ::lua_pushcfunction(pLua, LuaAsyncOperationGc);
+            ::lua_setfield(pLua, -2, "__gc");
+            ::lua_pushliteral(pLua, "async operation");
+            ::lua_setfield(pLua, -2, "__metatable");
+            ::lua_pushvalue(pLua, -1);
+            ::lua_rawsetp(pLua, LUA_REGISTRYINDEX, &LUA_ASYNC_OPERATION_KEY);
+        }
+        ::lua_setmetatable(pLua, -2);
+    }
+
+    static int LuaAsyncPushResult(lua_State * pLua, void * pOperation)
+    {
+        return ((LuaAsyncOperation *)pOperation)->PushResult(pLua);
+    }
+
+    //协程恢复后的延续函数, ctx是异步操作在栈上的位置
+    static int LuaAsyncContinue(lua_State * pLua, int status, lua_KContext ctx)
+    {
+        (void)status;
+        const int index = (int)ctx;
+        //丢弃lua_resume传入的值, 结果压在异步操作之后
+        ::lua_settop(pLua, index);
+        LuaAsyncOperation * pOperation = LuaAsyncToOperation(pLua, index);
+        if (!pOperation)
+        {
+            return ::luaL_error(pLua, "async operation was destroyed");
+        }
+        //future::get在结果未就绪时阻塞等待
+        return InvokeCppCallableCatching(pLua, LuaAsyncPushResult, pOperation);
+    }
+
+    int LuaAsyncYield(lua_State * pLua)
+    {
+        const int index = ::lua_gettop(pLua);
+        assert(LuaAsyncToOperation(pLua, index));
+        if (!::lua_isyieldable(pLua))
+        {
+            return LuaAsyncContinue(pLua, LUA_OK, (lua_KContext)index);
+        }
+        //复制一份交给lua_resume的调用者, 原来的留在栈上, 保证挂起期间不被回收
+        ::lua_pushvalue(pLua, index);
+        return ::lua_yieldk(pLua, 1, (lua_KContext)index, LuaAsyncContinue);
+    }
+}
+
+bool lua_async_pending(lua_State * co)
+{
+    assert(co);
+    return (::lua_status(co) == LUA_YIELD)
+        && (::lua_gettop(co) > 0)
+        && Internal::LuaAsyncIsOperation(co, -1);
+}
+
+bool lua_async_ready(lua_State * co)
+{
+    assert(co);
+    if (::lua_status(co) != LUA_YIELD)
+    {
+        return false;
+    }
+    if ((::lua_gettop(co) == 0) || !Internal::LuaAsyncIsOperation(co, -1))
+    {
+        return false;
+    }
+    //已经析构的操作视为就绪, 恢复时出错
+    Internal::LuaAsyncOperation * pOperation = Internal::LuaAsyncToOperation(co, -1);
+    return !pOperation || pOperation->IsReady();
+}
+
+int lua_async_resume(lua_State * co, lua_State * from)
+{
+    if (!lua_async_pending(co))
+    {
+        return LUA_ERRRUN;
+    }
+    //移除yield交出的值, 不向协程传入新的值
+    ::lua_pop(co, 1);
+    return ::lua_resume(co, from, 0);
+}
+
+SHARELIB_END_NAMESPACE
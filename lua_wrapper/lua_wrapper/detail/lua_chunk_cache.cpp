@@ -0,0 +1,267 @@
+﻿#include "../lua_chunk_cache.h"
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+SHARELIB_BEGIN_NAMESPACE
+
+namespace
+{
+    //文件的修改时间(秒)和大小
+    bool GetFileStat(const char * pFileName, long long & mtime, long long & fileSize)
+    {
+#ifdef _MSC_VER
+        struct _stat64 st;
+        if (::_stat64(pFileName, &st) != 0)
+        {
+            return false;
+        }
+#else
+        struct stat st;
+        if (::stat(pFileName, &st) != 0)
+        {
+            return false;
+        }
+#endif
+        mtime = (long long)st.st_mtime;
+        fileSize = (long long)st.st_size;
+        return true;
+    }
+
+    bool ReadWholeFile(const std::string & fileName, std::string & content)
+    {
+        std::ifstream file(fileName, std::ios::in | std::ios::binary);
+        if (!file)
+        {
+            return false;
+        }
+        file.seekg(0, std::ios::end);
+        auto len = file.tellg();
+        if (len < 0)
+        {
+            return false;
+        }
+        content.resize((size_t)len);
+        file.seekg(0, std::ios::beg);
+        if (len > 0)
+        {
+            file.read(&content[0], len);
+        }
+        return !!file;
+    }
+
+    //FNV-1a
+    uint64_t HashBytes(const char * pData, size_t len, uint64_t seed = 14695981039346656037ULL)
+    {
+        uint64_t hash = seed;
+        for (size_t i = 0; i < len; ++i)
+        {
+            hash ^= (unsigned char)pData[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    int ChunkWriter(lua_State * pLua, const void * p, size_t sz, void * ud)
+    {
+        (void)pLua;
+        ((std::string*)ud)->append((const char*)p, sz);
+        return 0;
+    }
+
+    //与luaL_loadfilex相同: 跳过UTF-8 BOM, 以及以'#'开头的第一行(保留换行符, 使行号不变)
+    size_t SkipSourceHeader(const std::string & content)
+    {
+        size_t pos = 0;
+        if (content.compare(0, 3, "\xEF\xBB\xBF") == 0)
+        {
+            pos = 3;
+        }
+        if (pos < content.size() && content[pos] == '#')
+        {
+            auto lineEnd = content.find('\n', pos);
+            pos = (lineEnd == std::string::npos) ? content.size() : lineEnd;
+        }
+        return pos;
+    }
+}
+
+lua_chunk_cache::lua_chunk_cache()
+{
+}
+
+lua_chunk_cache::lua_chunk_cache(const char * pSpillDir)
+    : m_spillDir(pSpillDir ? pSpillDir : "")
+{
+}
+
+int lua_chunk_cache::load_file(lua_State * pLua, const char * pFileName)
+{
+    assert(pLua);
+    assert(pFileName);
+    long long mtime = 0;
+    long long fileSize = 0;
+    if (!GetFileStat(pFileName, mtime, fileSize))
+    {
+        ::lua_pushfstring(pLua, "cannot open %s", pFileName);
+        return LUA_ERRFILE;
+    }
+
+    std::string fileName(pFileName);
+    std::string chunkName = "@" + fileName;
+    entry_ptr spEntry = find(fileName, mtime, fileSize);
+    if (spEntry)
+    {
+        return ::luaL_loadbufferx(pLua, spEntry->m_bytecode.data(), spEntry->m_bytecode.size(), chunkName.c_str(), "b");
+    }
+
+    //未命中, 编译结果留在栈顶
+    int err = LUA_ERRFILE;
+    spEntry = compile(pLua, fileName, chunkName, mtime, fileSize, err);
+    if (spEntry)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_entries[fileName] = spEntry;
+    }
+    return err;
+}
+
+void lua_chunk_cache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_entries.clear();
+}
+
+size_t lua_chunk_cache::size() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_entries.size();
+}
+
+lua_chunk_cache::entry_ptr lua_chunk_cache::find(const std::string & fileName, long long mtime, long long fileSize)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    auto it = m_entries.find(fileName);
+    //修改时间只精确到秒, 缓存的同一秒内再次写入时修改时间和大小都可能不变, 这时不能直接命中
+    if (it != m_entries.end()
+        && it->second->m_mtime == mtime
+        && it->second->m_fileSize == fileSize
+        && it->second->m_mtime < it->second->m_readTime)
+    {
+        return it->second;
+    }
+    return nullptr;
+}
+
+lua_chunk_cache::entry_ptr lua_chunk_cache::compile(lua_State * pLua, const std::string & fileName,
+    const std::string & chunkName, long long mtime, long long fileSize, int & err)
+{
+    //先取时间再读文件, 读取之后的修改不会早于这个时间
+    const long long readTime = (long long)std::time(nullptr);
+    std::string content;
+    if (!ReadWholeFile(fileName, content))
+    {
+        ::lua_pushfstring(pLua, "cannot read %s", fileName.c_str());
+        err = LUA_ERRFILE;
+        return nullptr;
+    }
+
+    auto spEntry = std::make_shared<chunk_entry>();
+    spEntry->m_mtime = mtime;
+    spEntry->m_fileSize = fileSize;
+    spEntry->m_readTime = readTime;
+    spEntry->m_hash = HashBytes(content.data(), content.size());
+
+    //只是修改时间变了, 内容没变
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        auto it = m_entries.find(fileName);
+        if (it != m_entries.end() && it->second->m_hash == spEntry->m_hash)
+        {
+            spEntry->m_bytecode = it->second->m_bytecode;
+        }
+    }
+
+    //磁盘上的缓存, 文件名同时包含路径, 以免相同内容的脚本共用调试信息中的源文件名
+    char spillName[32] = { 0 };
+    if (!m_spillDir.empty())
+    {
+        std::snprintf(spillName, sizeof(spillName), "%016llx",
+            (unsigned long long)HashBytes(fileName.data(), fileName.size(), spEntry->m_hash));
+        if (spEntry->m_bytecode.empty())
+        {
+            read_spill(spillName, spEntry->m_bytecode);
+        }
+    }
+
+    if (!spEntry->m_bytecode.empty())
+    {
+        err = ::luaL_loadbufferx(pLua, spEntry->m_bytecode.data(), spEntry->m_bytecode.size(), chunkName.c_str(), "b");
+        if (err == LUA_OK)
+        {
+            return spEntry;
+        }
+        //字节码与当前的lua版本不兼容, 重新编译
+        ::lua_pop(pLua, 1);
+        spEntry->m_bytecode.clear();
+    }
+
+    size_t pos = SkipSourceHeader(content);
+    err = ::luaL_loadbufferx(pLua, content.data() + pos, content.size() - pos, chunkName.c_str(), nullptr);
+    if (err != LUA_OK)
+    {
+        return nullptr;
+    }
+    ::lua_dump(pLua, ChunkWriter, &spEntry->m_bytecode, 0);
+    if (spillName[0])
+    {
+        write_spill(spillName, spEntry->m_bytecode);
+    }
+    return spEntry;
+}
+
+bool lua_chunk_cache::read_spill(const std::string & spillName, std::string & bytecode)
+{
+    if (!ReadWholeFile(m_spillDir + "/" + spillName + ".luac", bytecode))
+    {
+        bytecode.clear();
+        return false;
+    }
+    if (bytecode.compare(0, std::strlen(LUA_SIGNATURE), LUA_SIGNATURE) != 0)
+    {
+        bytecode.clear();
+        return false;
+    }
+    return true;
+}
+
+void lua_chunk_cache::write_spill(const std::string & spillName, const std::string & bytecode)
+{
+    //先写临时文件再改名, 避免其它进程读到写了一半的文件
+    std::string filePath = m_spillDir + "/" + spillName + ".luac";
+    std::string tempPath = filePath + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!file)
+        {
+            return;
+        }
+        file.write(bytecode.data(), bytecode.size());
+        if (!file)
+        {
+            file.close();
+            std::remove(tempPath.c_str());
+            return;
+        }
+    }
+    std::remove(filePath.c_str());
+    if (std::rename(tempPath.c_str(), filePath.c_str()) != 0)
+    {
+        std::remove(tempPath.c_str());
+    }
+}
+
+SHARELIB_END_NAMESPACE
@@ -0,0 +1,291 @@
+﻿#include "../lua_class.h"
+#include <cstdint>
+#include <cstring>
+
+SHARELIB_BEGIN_NAMESPACE
+
+namespace Internal
+{
+    //元表中保存LuaClassInfo的key, 取其地址
+    static const char LUA_CLASS_INFO_KEY = 0;
+    //元表中保存方法表、属性读写函数表的key, 派生类注册时从这里复制
+    static const char LUA_CLASS_METHODS_KEY = 0;
+    static const char LUA_CLASS_GETTERS_KEY = 0;
+    static const char LUA_CLASS_SETTERS_KEY = 0;
+
+    //index处是带有绑定类元表的userdata时返回对象头, 否则返回nullptr
+    static LuaObjectHeader * LuaClassToHeader(lua_State * pL, int index)
+    {
+        if ((::lua_type(pL, index) != LUA_TUSERDATA) || !::lua_getmetatable(pL, index))
+        {
+            return nullptr;
+        }
+        ::lua_rawgetp(pL, -1, &LUA_CLASS_INFO_KEY);
+        const LuaClassInfo * pInfo = (const LuaClassInfo *)::lua_touserdata(pL, -1);
+        ::lua_pop(pL, 2);
+        if (!pInfo)
+        {
+            return nullptr;
+        }
+        LuaObjectHeader * pHeader = (LuaObjectHeader *)::lua_touserdata(pL, index);
+        assert(pHeader->m_pClass == pInfo);
+        return pHeader;
+    }
+
+    static int LuaClassGc(lua_State * pL)
+    {
+        //元表被__metatable保护, 这里仍然检查参数, 防止通过debug库等直接调用
+        LuaObjectHeader * pHeader = LuaClassToHeader(pL, 1);
+        if (pHeader && pHeader->m_pfnDestroy)
+        {
+            auto pfnDestroy = pHeader->m_pfnDestroy;
+            void * pObject = pHeader->m_pObject;
+            pHeader->m_pfnDestroy = nullptr;
+            pHeader->m_pObject = nullptr;
+            pfnDestroy(pObject);
+        }
+        return 0;
+    }
+
+    //属性读写函数的调用, 经过InvokeCppCallableCatching转换C++异常
+    static int LuaClassCallAccessor(lua_State * pL, void * ppfn)
+    {
+        return (*(lua_CFunction *)ppfn)(pL);
+    }
+
+    //有属性时的__index, upvalue: 1 方法表, 2 属性读取函数表
+    static int LuaClassIndex(lua_State * pL)
+    {
+        ::lua_pushvalue(pL, 2);
+        if (::lua_rawget(pL, lua_upvalueindex(1)) != LUA_TNIL)
+        {
+            return 1;
+        }
+        ::lua_pushvalue(pL, 2);
+        ::lua_rawget(pL, lua_upvalueindex(2));
+        lua_CFunction pfnGet = ::lua_tocfunction(pL, -1);
+        if (!pfnGet)
+        {
+            return 1;
+        }
+        ::lua_settop(pL, 2);
+        return InvokeCppCallableCatching(pL, LuaClassCallAccessor, &pfnGet);
+    }
+
+    //__newindex, upvalue: 1 属性写入函数表
+    static int LuaClassNewIndex(lua_State * pL)
+    {
+        ::lua_pushvalue(pL, 2);
+        ::lua_rawget(pL, lua_upvalueindex(1));
+        lua_CFunction pfnSet = ::lua_tocfunction(pL, -1);
+        if (!pfnSet)
+        {
+            return ::luaL_error(pL, "'%s' is not a writable property", ::lua_tostring(pL, 2));
+        }
+        ::lua_settop(pL, 3);
+        return InvokeCppCallableCatching(pL, LuaClassCallAccessor, &pfnSet);
+    }
+
+    //创建元表中pKey对应的表, 复制所有直接基类的内容, 留在栈顶. 栈顶应是元表
+    static void LuaClassNewMemberTable(lua_State * pL, const LuaClassInfo * pInfo, const void * pKey)
+    {
+        const int metatable = ::lua_absindex(pL, -1);
+        ::lua_newtable(pL);
+        const int table = ::lua_gettop(pL);
+        for (int i = 0; i < pInfo->m_nBases; ++i)
+        {
+            if (LUA_TTABLE != ::lua_rawgetp(pL, LUA_REGISTRYINDEX, pInfo->m_ppBases[i]))
+            {
+                assert(!"base class must be registered first!");
+                ::lua_pop(pL, 1);
+                continue;
+            }
+            ::lua_rawgetp(pL, -1, pKey);
+            ::lua_pushnil(pL);
+            while (::lua_next(pL, -2) != 0)
+            {
+                //构造函数不继承
+                if ((pKey == &LUA_CLASS_METHODS_KEY)
+                    && (::lua_type(pL, -2) == LUA_TSTRING)
+                    && (std::strcmp(::lua_tostring(pL, -2), "new") == 0))
+                {
+                    ::lua_pop(pL, 1);
+                    continue;
+                }
+                ::lua_pushvalue(pL, -2);
+                ::lua_insert(pL, -2);
+                ::lua_rawset(pL, table);
+            }
+            ::lua_pop(pL, 2);
+        }
+        ::lua_pushvalue(pL, -1);
+        ::lua_rawsetp(pL, metatable, pKey);
+    }
+
+    static bool LuaClassIsEmptyTable(lua_State * pL, int index)
+    {
+        index = ::lua_absindex(pL, index);
+        ::lua_pushnil(pL);
+        if (::lua_next(pL, index) != 0)
+        {
+            ::lua_pop(pL, 2);
+            return false;
+        }
+        return true;
+    }
+
+    void * LuaClassCheckCast(lua_State * pL, int index, const LuaClassInfo * pTo)
+    {
+        LuaObjectHeader * pHeader = LuaClassToHeader(pL, index);
+        if (!pHeader || !pHeader->m_pObject)
+        {
+            return nullptr;
+        }
+        return LuaClassCast(pHeader->m_pClass, pHeader->m_pObject, pTo);
+    }
+
+    const char * LuaClassName(lua_State * pL, const LuaClassInfo * pInfo)
+    {
+        //名字保存在注册表中的元表里, 出栈后仍然有效
+        const char * pName = "userdata";
+        if (LUA_TTABLE == ::lua_rawgetp(pL, LUA_REGISTRYINDEX, pInfo))
+        {
+            if (LUA_TSTRING == ::lua_getfield(pL, -1, "__name"))
+            {
+                pName = ::lua_tostring(pL, -1);
+            }
+            ::lua_pop(pL, 1);
+        }
+        ::lua_pop(pL, 1);
+        return pName;
+    }
+
+    void LuaClassPushPointer(lua_State * pL, void * pObject, const LuaClassInfo * pInfo)
+    {
+        ::luaL_checkstack(pL, 2, "too many objects");
+        if (LUA_TTABLE != ::lua_rawgetp(pL, LUA_REGISTRYINDEX, pInfo))
+        {
+            ::lua_pop(pL, 1);
+            ::lua_pushlightuserdata(pL, pObject);
+            return;
+        }
+        LuaObjectHeader * pHeader = (LuaObjectHeader *)::lua_newuserdata(pL, sizeof(LuaObjectHeader));
+        pHeader->m_pClass = pInfo;
+        pHeader->m_pObject = pObject;
+        pHeader->m_pfnDestroy = nullptr;
+        ::lua_insert(pL, -2);
+        ::lua_setmetatable(pL, -2);
+    }
+
+    void * LuaClassNewObject(lua_State * pL, const LuaClassInfo * pInfo, size_t size, size_t align)
+    {
+        //lua_newuserdata的内存按LUAI_MAXALIGN对齐, 更大的对齐要求多分配一些再调整
+        size_t extra = (align > std::alignment_of<LuaObjectHeader>::value) ? (align - 1) : 0;
+        char * pBuffer = (char *)::lua_newuserdata(pL, sizeof(LuaObjectHeader) + extra + size);
+        std::uintptr_t address = (std::uintptr_t)(pBuffer + sizeof(LuaObjectHeader));
+        address = (address + align - 1) / align * align;
+        LuaObjectHeader * pHeader = (LuaObjectHeader *)pBuffer;
+        pHeader->m_pClass = pInfo;
+        pHeader->m_pObject = (void *)address;
+        pHeader->m_pfnDestroy = nullptr;
+        return pHeader->m_pObject;
+    }
+
+    bool LuaClassAttachObject(lua_State * pL, void(*pfnDestroy)(void *))
+    {
+        LuaObjectHeader * pHeader = (LuaObjectHeader *)::lua_touserdata(pL, -1);
+        assert(pHeader);
+        if (LUA_TTABLE != ::lua_rawgetp(pL, LUA_REGISTRYINDEX, pHeader->m_pClass))
+        {
+            ::lua_pop(pL, 1);
+            return false;
+        }
+        ::lua_setmetatable(pL, -2);
+        pHeader->m_pfnDestroy = pfnDestroy;
+        return true;
+    }
+
+    void LuaClassBeginRegister(lua_State * pL, const LuaClassInfo * pInfo, const char * pClassName)
+    {
+        ::luaL_checkstack(pL, 6, "too many objects");
+        ::lua_createtable(pL, 0, 8);
+        ::lua_pushcfunction(pL, LuaClassGc);
+        ::lua_setfield(pL, -2, "__gc");
+        ::lua_pushstring(pL, pClassName);
+        ::lua_setfield(pL, -2, "__name");
+        //脚本中getmetatable只能得到类名, 不能取得__gc和属性读写函数表, 也不能修改元表
+        ::lua_pushstring(pL, pClassName);
+        ::lua_setfield(pL, -2, "__metatable");
+        ::lua_pushlightuserdata(pL, (void *)pInfo);
+        ::lua_rawsetp(pL, -2, &LUA_CLASS_INFO_KEY);
+        ::lua_pushvalue(pL, -1);
+        ::lua_rawsetp(pL, LUA_REGISTRYINDEX, pInfo);
+
+        //基类的方法(构造函数除外)和属性先复制过来, 派生类的同名项之后覆盖
+        LuaClassNewMemberTable(pL, pInfo, &LUA_CLASS_GETTERS_KEY);
+        ::lua_pop(pL, 1);
+        LuaClassNewMemberTable(pL, pInfo, &LUA_CLASS_SETTERS_KEY);
+        ::lua_pop(pL, 1);
+        LuaClassNewMemberTable(pL, pInfo, &LUA_CLASS_METHODS_KEY);
+    }
+
+    void LuaClassAddProperty(lua_State * pL, const char * pName, lua_CFunction pfnGet, lua_CFunction pfnSet)
+    {
+        assert(pName && pfnGet);
+        ::luaL_checkstack(pL, 2, "too many objects");
+        ::lua_rawgetp(pL, -2, &LUA_CLASS_GETTERS_KEY);
+        ::lua_pushcfunction(pL, pfnGet);
+        ::lua_setfield(pL, -2, pName);
+        ::lua_pop(pL, 1);
+        //只读属性也要覆盖基类中同名的可写属性
+        ::lua_rawgetp(pL, -2, &LUA_CLASS_SETTERS_KEY);
+        if (pfnSet)
+        {
+            ::lua_pushcfunction(pL, pfnSet);
+        }
+        else
+        {
+            ::lua_pushnil(pL);
+        }
+        ::lua_setfield(pL, -2, pName);
+        ::lua_pop(pL, 1);
+    }
+
+    void LuaClassEndRegister(lua_State * pL, const char * pClassName)
+    {
+        assert(::lua_type(pL, -1) == LUA_TTABLE);
+        assert(::lua_type(pL, -2) == LUA_TTABLE);
+        ::luaL_checkstack(pL, 5, "too many objects");
+        const int metatable = ::lua_absindex(pL, -2);
+        const int methods = ::lua_absindex(pL, -1);
+
+        ::lua_rawgetp(pL, metatable, &LUA_CLASS_SETTERS_KEY);
+        if (!LuaClassIsEmptyTable(pL, -1))
+        {
+            ::lua_pushcclosure(pL, LuaClassNewIndex, 1);
+            ::lua_setfield(pL, metatable, "__newindex");
+        }
+        else
+        {
+            ::lua_pop(pL, 1);
+        }
+
+        //没有属性时__index直接是方法表, 由虚拟机查找
+        ::lua_pushvalue(pL, methods);
+        ::lua_rawgetp(pL, metatable, &LUA_CLASS_GETTERS_KEY);
+        if (!LuaClassIsEmptyTable(pL, -1))
+        {
+            ::lua_pushcclosure(pL, LuaClassIndex, 2);
+        }
+        else
+        {
+            ::lua_pop(pL, 1);
+        }
+        ::lua_setfield(pL, metatable, "__index");
+
+        ::lua_setglobal(pL, pClassName);
+        ::lua_pop(pL, 1);
+    }
+}
+
+SHARELIB_END_NAMESPACE
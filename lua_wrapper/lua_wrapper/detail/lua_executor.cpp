@@ -0,0 +1,168 @@
+﻿#include "../lua_executor.h"
+
+SHARELIB_BEGIN_NAMESPACE
+
+lua_executor::lua_executor()
+    : m_nextWorker(0)
+    , m_nPending(0)
+    , m_bRunning(false)
+{
+}
+
+lua_executor::~lua_executor()
+{
+    stop();
+}
+
+bool lua_executor::start(size_t nThreads, init_func_t fnInit)
+{
+    assert(m_workers.empty());
+    if (!m_workers.empty())
+    {
+        return false;
+    }
+    if (nThreads == 0)
+    {
+        nThreads = std::thread::hardware_concurrency();
+        if (nThreads == 0)
+        {
+            nThreads = 1;
+        }
+    }
+
+    std::vector<std::unique_ptr<worker> > workers;
+    for (size_t i = 0; i < nThreads; ++i)
+    {
+        std::unique_ptr<worker> spWorker(new worker);
+        if (!spWorker->m_lua.create())
+        {
+            return false;
+        }
+        if (fnInit && !fnInit(spWorker->m_lua))
+        {
+            return false;
+        }
+        workers.push_back(std::move(spWorker));
+    }
+
+    m_workers.swap(workers);
+    {
+        std::lock_guard<std::mutex> lock(m_waitLock);
+        m_nPending = 0;
+        m_bRunning = true;
+    }
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        m_workers[i]->m_thread = std::thread(&lua_executor::worker_proc, this, i);
+    }
+    return true;
+}
+
+void lua_executor::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_waitLock);
+        m_bRunning = false;
+    }
+    m_waitCond.notify_all();
+    for (auto & spWorker : m_workers)
+    {
+        if (spWorker->m_thread.joinable())
+        {
+            spWorker->m_thread.join();
+        }
+    }
+    m_workers.clear();
+}
+
+size_t lua_executor::thread_count() const
+{
+    return m_workers.size();
+}
+
+bool lua_executor::post(task_t task)
+{
+    assert(task);
+    {
+        //加锁顺序: m_waitLock, 然后是worker::m_lock
+        std::lock_guard<std::mutex> lock(m_waitLock);
+        if (!m_bRunning || !task)
+        {
+            return false;
+        }
+        auto & spWorker = m_workers[m_nextWorker++ % m_workers.size()];
+        {
+            std::lock_guard<std::mutex> workerLock(spWorker->m_lock);
+            spWorker->m_tasks.push_back(std::move(task));
+        }
+        ++m_nPending;
+    }
+    m_waitCond.notify_one();
+    return true;
+}
+
+bool lua_executor::pop_task(size_t index, task_t & task)
+{
+    //先从自己的队列尾部取, 再从其它线程的队列头部窃取
+    bool bFound = false;
+    {
+        auto & self = *m_workers[index];
+        std::lock_guard<std::mutex> workerLock(self.m_lock);
+        if (!self.m_tasks.empty())
+        {
+            task = std::move(self.m_tasks.back());
+            self.m_tasks.pop_back();
+            bFound = true;
+        }
+    }
+    for (size_t i = 1; !bFound && i < m_workers.size(); ++i)
+    {
+        auto & victim = *m_workers[(index + i) % m_workers.size()];
+        std::lock_guard<std::mutex> workerLock(victim.m_lock);
+        if (!victim.m_tasks.empty())
+        {
+            task = std::move(victim.m_tasks.front());
+            victim.m_tasks.pop_front();
+            bFound = true;
+        }
+    }
+    if (bFound)
+    {
+        std::lock_guard<std::mutex> lock(m_waitLock);
+        assert(m_nPending > 0);
+        --m_nPending;
+    }
+    return bFound;
+}
+
+void lua_executor::worker_proc(size_t index)
+{
+    auto & lua = m_workers[index]->m_lua;
+    task_t task;
+    for (;;)
+    {
+        if (pop_task(index, task))
+        {
+            try
+            {
+                task(lua);
+            }
+            catch (...)
+            {
+                assert(!"lua_executor task throw exception!");
+            }
+            task = nullptr;
+            ::lua_settop(lua, 0);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_waitLock);
+        m_waitCond.wait(lock, [this]() { return (m_nPending > 0) || !m_bRunning; });
+        if (m_nPending == 0 && !m_bRunning)
+        {
+            break;
+        }
+    }
+}
+
+SHARELIB_END_NAMESPACE
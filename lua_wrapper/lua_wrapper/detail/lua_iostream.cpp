@@ -4,10 +4,11 @@ SHARELIB_BEGIN_NAMESPACE
 
 const lua_ostream::table_begin_t lua_ostream::table_begin;
 const lua_ostream::table_end_t lua_ostream::table_end;
+const lua_istream::table_begin_t lua_istream::table_begin;
+const lua_istream::table_end_t lua_istream::table_end;
 
 lua_ostream::lua_ostream(lua_State * pLua)
 : m_pLua(pLua)
-, m_tableIndex(0)
 {
     assert(m_pLua);
 }
@@ -76,6 +77,13 @@ lua_ostream & lua_ostream::operator<<(const char * value)
     return *this;
 }
 
+lua_ostream & lua_ostream::operator<<(lua_string_ref value)
+{
+    ::lua_pushlstring(m_pLua, value.m_pStr, value.m_len);
+    check_table_push();
+    return *this;
+}
+
 lua_ostream & lua_ostream::operator<<(wchar_t * value)
 {
     return (*this) << (const wchar_t*)value;
@@ -86,39 +94,48 @@ lua_ostream & lua_ostream::operator<<(const wchar_t * value)
     return (*this) << std::wstring(value);
 }
 
-lua_ostream & lua_ostream::operator<<(table_begin_t)
+lua_ostream & lua_ostream::operator<<(table_begin_t tableBegin)
 {
-    assert(m_tableIndex == 0);
-    ::lua_newtable(m_pLua);
-    m_tableIndex = ::lua_gettop(m_pLua);
+    assert(tableBegin.m_nArray >= 0 && tableBegin.m_nHash >= 0);
+    //外层table, 可能有的key, 新table
+    ::luaL_checkstack(m_pLua, 3, "too many nested tables");
+    ::lua_createtable(m_pLua, tableBegin.m_nArray, tableBegin.m_nHash);
+    frame_t frame = { ::lua_gettop(m_pLua), 1 };
+    m_frames.push(frame);
     return *this;
 }
 
 lua_ostream & lua_ostream::operator<<(table_end_t)
 {
-    assert(m_tableIndex > 0);
-    assert(::lua_type(m_pLua, m_tableIndex) == LUA_TTABLE);
-    assert(::lua_gettop(m_pLua) == m_tableIndex);
-    m_tableIndex = 0;
+    assert(!m_frames.empty());
+    if (!m_frames.empty())
+    {
+        assert(::lua_type(m_pLua, m_frames.top().m_tableIndex) == LUA_TTABLE);
+        assert(::lua_gettop(m_pLua) == m_frames.top().m_tableIndex);
+        m_frames.pop();
+        //嵌套的子table写完, 插入外层table
+        check_table_push();
+    }
     return *this;
 }
 
 void lua_ostream::check_table_push()
 {
-    if (m_tableIndex > 0)
+    if (!m_frames.empty())
     {
-        assert(::lua_type(m_pLua, m_tableIndex) == LUA_TTABLE);
-        auto nOffset = ::lua_gettop(m_pLua) - m_tableIndex;
+        frame_t & frame = m_frames.top();
+        assert(::lua_type(m_pLua, frame.m_tableIndex) == LUA_TTABLE);
+        auto nOffset = ::lua_gettop(m_pLua) - frame.m_tableIndex;
         if (nOffset == 1)
         {
             //没有key
-            ::lua_rawseti(m_pLua, m_tableIndex, ::lua_rawlen(m_pLua, m_tableIndex) + 1);
+            ::lua_rawseti(m_pLua, frame.m_tableIndex, frame.m_arrayIndex++);
         }
         else
         {
             assert(nOffset == 2);
             assert(::lua_type(m_pLua, -2) == LUA_TSTRING);
-            ::lua_rawset(m_pLua, m_tableIndex);
+            ::lua_rawset(m_pLua, frame.m_tableIndex);
             assert(::lua_type(m_pLua, -1) == LUA_TTABLE);
         }
     }
@@ -127,8 +144,8 @@ void lua_ostream::check_table_push()
 lua_ostream & lua_ostream::operator<<(lua_table_key_t key)
 {
     assert(key.m_pKey);
-    assert(m_tableIndex > 0);
-    assert(::lua_gettop(m_pLua) == m_tableIndex);
+    assert(!m_frames.empty());
+    assert(::lua_gettop(m_pLua) == m_frames.top().m_tableIndex);
     ::lua_pushstring(m_pLua, key.m_pKey);
     return *this;
 }
@@ -137,9 +154,9 @@ void lua_ostream::insert_subtable(lua_ostream & subTable)
 {
     (void)subTable;
     assert(subTable.m_pLua == m_pLua);
-    assert(m_tableIndex > 0);
-    assert(::lua_gettop(m_pLua) > m_tableIndex);
-    assert(subTable.m_tableIndex == 0);
+    assert(!m_frames.empty());
+    assert(::lua_gettop(m_pLua) > m_frames.top().m_tableIndex);
+    assert(subTable.m_frames.empty());
     assert(::lua_type(m_pLua, -1) == LUA_TTABLE);
     check_table_push();
 }
@@ -150,24 +167,38 @@ lua_istream::lua_istream(lua_State * pLua, int stackIndex)
     : m_pLua(pLua)
     , m_stackIndex(::lua_absindex(pLua, stackIndex))
     , m_top(::lua_gettop(pLua))
-    , m_isEof(false)
     , m_isOK(true)
-    , m_isTableKey(false)
 {
     assert(pLua);
-    if (m_stackIndex != 0)
+    push_frame(m_stackIndex);
+}
+
+void lua_istream::push_frame(int stackIndex)
+{
+    frame_t frame = { stackIndex, ::lua_gettop(m_pLua), false, false, false };
+    if (stackIndex != 0)
     {
-        auto valueType = ::lua_type(m_pLua, m_stackIndex);
+        auto valueType = ::lua_type(m_pLua, stackIndex);
         if ((valueType == LUA_TNIL) || (valueType == LUA_TNONE))
         {
-            m_isEof = true;
+            frame.m_isEof = true;
         }
         else if (valueType == LUA_TTABLE)
         {
-            ::lua_pushnil(m_pLua);
-            m_isEof = (::lua_next(m_pLua, m_stackIndex) == 0);
+            //遍历用的键值对, 以及按key读取的值
+            if (::lua_checkstack(m_pLua, 3))
+            {
+                frame.m_isTable = true;
+                ::lua_pushnil(m_pLua);
+                frame.m_isEof = (::lua_next(m_pLua, stackIndex) == 0);
+            }
+            else
+            {
+                frame.m_isEof = true;
+            }
         }
     }
+    m_frames.push(frame);
 }
 
 lua_istream::~lua_istream()
@@ -190,7 +221,7 @@ int lua_istream::index() const
 
 bool lua_istream::eof() const
 {
-    return m_isEof;
+    return m_frames.top().m_isEof;
 }
 
 bool lua_istream::bad() const
@@ -205,12 +236,13 @@ lua_istream::operator void*() const
 
 bool lua_istream::is_subtable() const
 {
-    assert(::lua_type(m_pLua, m_stackIndex) == LUA_TTABLE);
-    if (::lua_type(m_pLua, m_stackIndex) != LUA_TTABLE)
+    const frame_t & frame = m_frames.top();
+    assert(frame.m_isTable);
+    if (!frame.m_isTable)
     {
         return false;
     }
-    else if (m_isEof)
+    else if (frame.m_isEof)
     {
         return false;
     }
@@ -222,7 +254,7 @@ bool lua_istream::is_subtable() const
 
 lua_istream & lua_istream::operator>>(bool & value)
 {
-    if (!m_isEof)
+    if (!eof())
     {
         m_isOK = (::lua_type(m_pLua, get_value_index()) == LUA_TBOOLEAN);
         if (m_isOK)
@@ -237,7 +269,7 @@ lua_istream & lua_istream::operator>>(bool & value)
 #define IMPLEMENT_LUA_ISTREAM_INTEGER(type) \
 lua_istream & lua_istream::operator>>(type & value) \
 { \
-    if (!m_isEof) \
+    if (!eof()) \
     { \
         m_isOK = (::lua_type(m_pLua, get_value_index()) == LUA_TNUMBER); \
         if (m_isOK) \
@@ -264,7 +296,7 @@ IMPLEMENT_LUA_ISTREAM_INTEGER(unsigned long long)
 #define IMPLEMENT_LUA_ISTREAM_FLOAT_POINT(type) \
 lua_istream & lua_istream::operator>>(type & value) \
 { \
-    if (!m_isEof) \
+    if (!eof()) \
     { \
         m_isOK = (::lua_type(m_pLua, get_value_index()) == LUA_TNUMBER); \
         if (m_isOK) \
@@ -280,16 +312,69 @@ IMPLEMENT_LUA_ISTREAM_FLOAT_POINT(double)
 IMPLEMENT_LUA_ISTREAM_FLOAT_POINT(long double)
 #undef IMPLEMENT_LUA_ISTREAM_FLOAT_POINT
 
+lua_istream & lua_istream::operator>>(lua_string_ref & value)
+{
+    if (!eof())
+    {
+        int index = get_value_index();
+        m_isOK = (::lua_type(m_pLua, index) == LUA_TSTRING);
+        if (m_isOK)
+        {
+            value.m_pStr = ::lua_tolstring(m_pLua, index, &value.m_len);
+        }
+        next();
+    }
+    return *this;
+}
+
 lua_istream & lua_istream::operator>>(lua_table_key_t key)
 {
-    assert(!m_isEof);
-    if (!m_isEof)
+    frame_t & frame = m_frames.top();
+    assert(!frame.m_isEof);
+    if (!frame.m_isEof)
     {
-        assert(::lua_type(m_pLua, m_stackIndex) == LUA_TTABLE);
-        assert(::lua_gettop(m_pLua) == m_top + 2);
+        assert(frame.m_isTable);
+        assert(::lua_gettop(m_pLua) == frame.m_top + 2);
         ::lua_pushstring(m_pLua, key.m_pKey);
-        ::lua_rawget(m_pLua, m_stackIndex);
-        m_isTableKey = true;
+        ::lua_rawget(m_pLua, frame.m_stackIndex);
+        frame.m_isTableKey = true;
+    }
+    return *this;
+}
+
+lua_istream & lua_istream::operator>>(table_begin_t)
+{
+    if (!m_frames.top().m_isEof)
+    {
+        //值在栈顶, 或者就是最底层的非table值, 作为新一层的起点
+        int index = ::lua_absindex(m_pLua, get_value_index());
+        m_isOK = (::lua_type(m_pLua, index) == LUA_TTABLE);
+        push_frame(m_isOK ? index : 0);
+    }
+    else
+    {
+        m_isOK = false;
+        push_frame(0);
+    }
+    if (m_frames.top().m_stackIndex == 0)
+    {
+        //失败时这一层直接读完
+        m_frames.top().m_isEof = true;
+    }
+    return *this;
+}
+
+lua_istream & lua_istream::operator>>(table_end_t)
+{
+    assert(m_frames.size() > 1);
+    if (m_frames.size() > 1)
+    {
+        ::lua_settop(m_pLua, m_frames.top().m_top);
+        m_frames.pop();
+        if (!m_frames.top().m_isEof)
+        {
+            next();
+        }
     }
     return *this;
 }
@@ -297,50 +382,52 @@ lua_istream & lua_istream::operator>>(lua_table_key_t key)
 void lua_istream::cleanup_subtable(lua_istream & subTable)
 {
     (void)subTable;
-    assert(!m_isEof);
-    assert(::lua_type(m_pLua, m_stackIndex) == LUA_TTABLE);
+    assert(!m_frames.top().m_isEof);
+    assert(m_frames.top().m_isTable);
     assert(::lua_type(subTable.m_pLua, subTable.m_stackIndex) == LUA_TTABLE);
     assert(m_pLua == subTable.m_pLua);
-    assert(m_stackIndex < subTable.m_stackIndex);
+    assert(m_frames.top().m_stackIndex < subTable.m_stackIndex);
     m_isOK = true;
     next();
 }
 
 int lua_istream::get_value_index()
 {
-    assert(!m_isEof);
-    if (::lua_type(m_pLua, m_stackIndex) == LUA_TTABLE)
+    const frame_t & frame = m_frames.top();
+    assert(!frame.m_isEof);
+    if (frame.m_isTable)
     {
         return -1;
     }
     else
     {
-        return m_stackIndex;
+        return frame.m_stackIndex;
     }
 }
 
 void lua_istream::next()
 {
-    assert(!m_isEof);
-    if (::lua_type(m_pLua, m_stackIndex) == LUA_TTABLE)
+    frame_t & frame = m_frames.top();
+    assert(!frame.m_isEof);
+    if (frame.m_isTable)
     {
-        assert(::lua_gettop(m_pLua) >= m_top + 2);
-        if (m_isTableKey)
+        assert(::lua_gettop(m_pLua) >= frame.m_top + 2);
+        if (frame.m_isTableKey)
         {
-            ::lua_settop(m_pLua, m_top + 2);
-            m_isEof = false;
-            m_isTableKey = false;
+            ::lua_settop(m_pLua, frame.m_top + 2);
+            frame.m_isEof = false;
+            frame.m_isTableKey = false;
         }
         else
         {
-            ::lua_settop(m_pLua, m_top + 1);
-            m_isEof = (::lua_next(m_pLua, m_stackIndex) == 0);
+            ::lua_settop(m_pLua, frame.m_top + 1);
+            frame.m_isEof = (::lua_next(m_pLua, frame.m_stackIndex) == 0);
         }
     }
     else
     {
-        assert(::lua_gettop(m_pLua) == m_top);
-        m_isEof = true;
+        assert(::lua_gettop(m_pLua) == frame.m_top);
+        frame.m_isEof = true;
     }
 }
 
@@ -0,0 +1,342 @@
+﻿#include "../lua_scheduler.h"
+#include "../lua_async.h"
+#include <algorithm>
+#include <thread>
+
+SHARELIB_BEGIN_NAMESPACE
+
+namespace Internal
+{
+    //sleep挂起时交出的标记, 取其地址
+    static const char LUA_SCHEDULER_SLEEP_KEY = 0;
+
+    //注册表中正在运行任务的调度器的key, 取其地址
+    static const char LUA_SCHEDULER_CURRENT_KEY = 0;
+
+    static int LuaSchedulerSleep(lua_State * pLua)
+    {
+        lua_Number seconds = ::luaL_optnumber(pLua, 1, 0);
+        if (!::lua_isyieldable(pLua))
+        {
+            return ::luaL_error(pLua, "sleep must be called in a scheduler task");
+        }
+        ::lua_pushlightuserdata(pLua, (void *)&LUA_SCHEDULER_SLEEP_KEY);
+        ::lua_pushnumber(pLua, seconds);
+        return ::lua_yield(pLua, 2);
+    }
+}
+
+//按唤醒时间的小顶堆
+struct lua_scheduler_wake_later
+{
+    template<class T>
+    bool operator()(const T & left, const T & right) const
+    {
+        return left.m_wakeTime > right.m_wakeTime;
+    }
+};
+
+lua_scheduler::lua_scheduler(lua_State * pLua)
+    : m_pLua(pLua)
+    , m_nextId(0)
+    , m_nMaxFreeThreads(256)
+    , m_nTimeSlice(0)
+    , m_pCurrentThread(nullptr)
+    , m_bPreempted(false)
+{
+    assert(m_pLua);
+}
+
+lua_scheduler::~lua_scheduler()
+{
+    ::lua_rawgetp(m_pLua, LUA_REGISTRYINDEX, &Internal::LUA_SCHEDULER_CURRENT_KEY);
+    const bool isCurrent = (::lua_touserdata(m_pLua, -1) == this);
+    ::lua_pop(m_pLua, 1);
+    if (isCurrent)
+    {
+        ::lua_pushnil(m_pLua);
+        ::lua_rawsetp(m_pLua, LUA_REGISTRYINDEX, &Internal::LUA_SCHEDULER_CURRENT_KEY);
+    }
+    for (auto & item : m_ready)
+    {
+        for (auto & t : item.second)
+        {
+            ::luaL_unref(m_pLua, LUA_REGISTRYINDEX, t.m_threadRef);
+        }
+    }
+    for (auto & t : m_sleeping)
+    {
+        ::luaL_unref(m_pLua, LUA_REGISTRYINDEX, t.m_threadRef);
+    }
+    for (auto & t : m_waiting)
+    {
+        ::luaL_unref(m_pLua, LUA_REGISTRYINDEX, t.m_threadRef);
+    }
+    for (auto & item : m_freeThreads)
+    {
+        ::luaL_unref(m_pLua, LUA_REGISTRYINDEX, item.second);
+    }
+}
+
+void lua_scheduler::register_sleep(const char * pName)
+{
+    assert(pName);
+    ::lua_pushcfunction(m_pLua, Internal::LuaSchedulerSleep);
+    ::lua_setglobal(m_pLua, pName);
+}
+
+lua_State * lua_scheduler::acquire_thread(int & threadRef)
+{
+    if (!m_freeThreads.empty())
+    {
+        auto item = m_freeThreads.back();
+        m_freeThreads.pop_back();
+        threadRef = item.second;
+        return item.first;
+    }
+    lua_State * pThread = ::lua_newthread(m_pLua);
+    threadRef = ::luaL_ref(m_pLua, LUA_REGISTRYINDEX);
+    return pThread;
+}
+
+void lua_scheduler::release_thread(lua_State * pThread, int threadRef, bool bReusable)
+{
+    //只有正常结束的协程可以再次运行, 出错的协程状态无法恢复
+    if (bReusable && (m_freeThreads.size() < m_nMaxFreeThreads) && (::lua_status(pThread) == LUA_OK))
+    {
+        ::lua_settop(pThread, 0);
+        m_freeThreads.emplace_back(pThread, threadRef);
+    }
+    else
+    {
+        ::luaL_unref(m_pLua, LUA_REGISTRYINDEX, threadRef);
+    }
+}
+
+lua_scheduler::task_id_t lua_scheduler::add_task(lua_State * pThread, int threadRef, int nArgs, int priority, double seconds)
+{
+    if (++m_nextId == 0)
+    {
+        ++m_nextId;
+    }
+    task t{ m_nextId, pThread, threadRef, priority, nArgs, false, clock_t::time_point() };
+    if (seconds > 0)
+    {
+        t.m_wakeTime = clock_t::now() + std::chrono::duration_cast<clock_t::duration>(std::chrono::duration<double>(seconds));
+        push_sleeping(std::move(t));
+    }
+    else
+    {
+        push_ready(std::move(t));
+    }
+    return m_nextId;
+}
+
+void lua_scheduler::push_ready(task && t)
+{
+    m_ready[t.m_priority].push_back(std::move(t));
+}
+
+void lua_scheduler::push_sleeping(task && t)
+{
+    m_sleeping.push_back(std::move(t));
+    std::push_heap(m_sleeping.begin(), m_sleeping.end(), lua_scheduler_wake_later());
+}
+
+void lua_scheduler::resume_task(task & t)
+{
+    lua_State * pThread = t.m_pThread;
+    if (m_nTimeSlice > 0)
+    {
+        //每次lua_sethook都重新开始计数
+        ::lua_pushlightuserdata(m_pLua, this);
+        ::lua_rawsetp(m_pLua, LUA_REGISTRYINDEX, &Internal::LUA_SCHEDULER_CURRENT_KEY);
+        ::lua_sethook(pThread, time_slice_hook, LUA_MASKCOUNT, m_nTimeSlice);
+    }
+    m_pCurrentThread = pThread;
+    m_bPreempted = false;
+    int status = LUA_OK;
+    if (t.m_bPreempted)
+    {
+        //在钩子中挂起时栈顶是lua函数的寄存器, 不是交出的值, 不能当作异步操作检查
+        status = ::lua_resume(pThread, m_pLua, 0);
+    }
+    else if (lua_async_pending(pThread))
+    {
+        status = lua_async_resume(pThread, m_pLua);
+    }
+    else
+    {
+        if (::lua_status(pThread) == LUA_YIELD)
+        {
+            //移除上次yield交出的值, 不向协程传入新的值
+            ::lua_settop(pThread, 0);
+        }
+        status = ::lua_resume(pThread, m_pLua, t.m_nArgs);
+        t.m_nArgs = 0;
+    }
+    m_pCurrentThread = nullptr;
+
+    t.m_bPreempted = (status == LUA_YIELD) && m_bPreempted;
+    m_bPreempted = false;
+    if (status == LUA_YIELD)
+    {
+        if (t.m_bPreempted)
+        {
+            push_ready(std::move(t));
+        }
+        else if (lua_async_pending(pThread))
+        {
+            m_waiting.push_back(std::move(t));
+        }
+        else if ((::lua_gettop(pThread) >= 2)
+            && (::lua_touserdata(pThread, -2) == (void *)&Internal::LUA_SCHEDULER_SLEEP_KEY))
+        {
+            t.m_wakeTime = clock_t::now()
+                + std::chrono::duration_cast<clock_t::duration>(std::chrono::duration<double>(::lua_tonumber(pThread, -1)));
+            push_sleeping(std::move(t));
+        }
+        else
+        {
+            push_ready(std::move(t));
+        }
+        return;
+    }
+
+    if (status != LUA_OK)
+    {
+        if (m_fnError)
+        {
+            const char * pMsg = ::lua_tostring(pThread, -1);
+            m_fnError(t.m_id, pMsg ? pMsg : "unknown error");
+        }
+    }
+    if (::lua_gethook(pThread) == time_slice_hook)
+    {
+        ::lua_sethook(pThread, nullptr, 0, 0);
+    }
+    release_thread(pThread, t.m_threadRef, status == LUA_OK);
+}
+
+void lua_scheduler::time_slice_hook(lua_State * pLua, lua_Debug *)
+{
+    ::lua_rawgetp(pLua, LUA_REGISTRYINDEX, &Internal::LUA_SCHEDULER_CURRENT_KEY);
+    lua_scheduler * pScheduler = (lua_scheduler *)::lua_touserdata(pLua, -1);
+    ::lua_pop(pLua, 1);
+    //任务中创建的协程继承了钩子, 不能挂起
+    if (pScheduler && (pScheduler->m_nTimeSlice > 0) && (pScheduler->m_pCurrentThread == pLua) && ::lua_isyieldable(pLua))
+    {
+        pScheduler->m_bPreempted = true;
+        ::lua_yield(pLua, 0);
+    }
+}
+
+size_t lua_scheduler::run_once()
+{
+    const clock_t::time_point now = clock_t::now();
+    while (!m_sleeping.empty() && (m_sleeping.front().m_wakeTime <= now))
+    {
+        std::pop_heap(m_sleeping.begin(), m_sleeping.end(), lua_scheduler_wake_later());
+        push_ready(std::move(m_sleeping.back()));
+        m_sleeping.pop_back();
+    }
+    for (size_t i = 0; i < m_waiting.size();)
+    {
+        if (lua_async_ready(m_waiting[i].m_pThread))
+        {
+            push_ready(std::move(m_waiting[i]));
+            m_waiting[i] = std::move(m_waiting.back());
+            m_waiting.pop_back();
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    //本轮只运行现在可运行的任务, 运行中新加入的留到下一轮
+    m_running.clear();
+    for (auto & item : m_ready)
+    {
+        for (auto & t : item.second)
+        {
+            m_running.push_back(std::move(t));
+        }
+        item.second.clear();
+    }
+    for (auto & t : m_running)
+    {
+        resume_task(t);
+    }
+    m_running.clear();
+    return task_count();
+}
+
+void lua_scheduler::run()
+{
+    while (run_once() > 0)
+    {
+        bool bHasReady = false;
+        for (auto & item : m_ready)
+        {
+            if (!item.second.empty())
+            {
+                bHasReady = true;
+                break;
+            }
+        }
+        if (bHasReady)
+        {
+            continue;
+        }
+        //等待异步结果时只能轮询, 间隔1毫秒
+        clock_t::time_point wakeTime = clock_t::now() + std::chrono::milliseconds(1);
+        if (m_waiting.empty() && !m_sleeping.empty())
+        {
+            wakeTime = m_sleeping.front().m_wakeTime;
+        }
+        else if (!m_sleeping.empty() && (m_sleeping.front().m_wakeTime < wakeTime))
+        {
+            wakeTime = m_sleeping.front().m_wakeTime;
+        }
+        std::this_thread::sleep_until(wakeTime);
+    }
+}
+
+size_t lua_scheduler::task_count() const
+{
+    size_t nCount = m_sleeping.size() + m_waiting.size() + m_running.size();
+    for (auto & item : m_ready)
+    {
+        nCount += item.second.size();
+    }
+    return nCount;
+}
+
+size_t lua_scheduler::free_thread_count() const
+{
+    return m_freeThreads.size();
+}
+
+void lua_scheduler::set_max_free_threads(size_t nCount)
+{
+    m_nMaxFreeThreads = nCount;
+    while (m_freeThreads.size() > m_nMaxFreeThreads)
+    {
+        ::luaL_unref(m_pLua, LUA_REGISTRYINDEX, m_freeThreads.back().second);
+        m_freeThreads.pop_back();
+    }
+}
+
+void lua_scheduler::set_error_handler(error_func_t fnError)
+{
+    m_fnError = std::move(fnError);
+}
+
+void lua_scheduler::set_time_slice(int nInstructions)
+{
+    assert(nInstructions >= 0);
+    m_nTimeSlice = nInstructions;
+}
+
+SHARELIB_END_NAMESPACE
@@ -0,0 +1,171 @@
+﻿#include "../lua_state_pool.h"
+
+SHARELIB_BEGIN_NAMESPACE
+
+lua_state_pool::lease::lease()
+    : m_pPool(nullptr)
+{
+}
+
+lua_state_pool::lease::lease(lua_state_pool * pPool, std::unique_ptr<lua_state_wrapper> && spLua)
+    : m_pPool(pPool)
+    , m_spLua(std::move(spLua))
+{
+}
+
+lua_state_pool::lease::lease(lease && other)
+    : m_pPool(other.m_pPool)
+    , m_spLua(std::move(other.m_spLua))
+{
+    other.m_pPool = nullptr;
+}
+
+lua_state_pool::lease & lua_state_pool::lease::operator=(lease && other)
+{
+    if (this != &other)
+    {
+        reset();
+        m_pPool = other.m_pPool;
+        m_spLua = std::move(other.m_spLua);
+        other.m_pPool = nullptr;
+    }
+    return *this;
+}
+
+lua_state_pool::lease::~lease()
+{
+    reset();
+}
+
+bool lua_state_pool::lease::valid() const
+{
+    return !!m_spLua;
+}
+
+lua_state_wrapper * lua_state_pool::lease::get() const
+{
+    return m_spLua.get();
+}
+
+lua_state_wrapper * lua_state_pool::lease::operator->() const
+{
+    assert(m_spLua);
+    return m_spLua.get();
+}
+
+lua_state_wrapper & lua_state_pool::lease::operator*() const
+{
+    assert(m_spLua);
+    return *m_spLua;
+}
+
+void lua_state_pool::lease::reset()
+{
+    if (m_pPool && m_spLua)
+    {
+        m_pPool->release(std::move(m_spLua));
+    }
+    m_spLua.reset();
+    m_pPool = nullptr;
+}
+
+//----------------------------------------------------------------
+
+lua_state_pool::lua_state_pool(init_func_t fnInit, size_t nMaxIdle)
+    : m_fnInit(std::move(fnInit))
+    , m_nMaxIdle(nMaxIdle)
+{
+}
+
+lua_state_pool::~lua_state_pool()
+{
+}
+
+lua_state_pool::lease lua_state_pool::acquire()
+{
+    std::unique_ptr<lua_state_wrapper> spLua;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (!m_idleStates.empty())
+        {
+            spLua = std::move(m_idleStates.back());
+            m_idleStates.pop_back();
+        }
+    }
+    if (!spLua)
+    {
+        //新建不需要加锁, 初始化可能比较耗时
+        spLua = create_state();
+    }
+    if (!spLua)
+    {
+        return lease();
+    }
+    return lease(this, std::move(spLua));
+}
+
+size_t lua_state_pool::prepare(size_t count)
+{
+    if (count > m_nMaxIdle)
+    {
+        count = m_nMaxIdle;
+    }
+    while (idle_count() < count)
+    {
+        auto spLua = create_state();
+        if (!spLua)
+        {
+            break;
+        }
+        release(std::move(spLua));
+    }
+    return idle_count();
+}
+
+size_t lua_state_pool::idle_count() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_idleStates.size();
+}
+
+std::unique_ptr<lua_state_wrapper> lua_state_pool::create_state()
+{
+    std::unique_ptr<lua_state_wrapper> spLua(new lua_state_wrapper);
+    if (!spLua->create())
+    {
+        return nullptr;
+    }
+    if (m_fnInit && !m_fnInit(*spLua))
+    {
+        return nullptr;
+    }
+    if (!spLua->snapshot_globals())
+    {
+        return nullptr;
+    }
+    return spLua;
+}
+
+void lua_state_pool::release(std::unique_ptr<lua_state_wrapper> && spLua)
+{
+    assert(spLua);
+    if (!spLua->reset_globals())
+    {
+        return;
+    }
+    std::unique_ptr<lua_state_wrapper> spDiscard;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (m_idleStates.size() < m_nMaxIdle)
+        {
+            m_idleStates.push_back(std::move(spLua));
+        }
+        else
+        {
+            //在锁外关闭
+            spDiscard = std::move(spLua);
+        }
+    }
+}
+
+SHARELIB_END_NAMESPACE
@@ -1,9 +1,293 @@
 ﻿#include "../lua_wrapper.h"
+#include "../lua_allocator.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <new>
 #include <string>
+#include <typeinfo>
+#include <utility>
+#ifdef __GNUC__
+#include <cxxabi.h>
+#endif
 
 SHARELIB_BEGIN_NAMESPACE
 
-static const char * LUA_CHUNK_FUNC_NAME = "COMPILED_LUA_FUNC";
+//注册表中全局变量快照的key, 取其地址
+static const char LUA_GLOBALS_SNAPSHOT_KEY = 0;
+//快照时_G的元表和load_lua_xxx加载的脚本, 取其地址
+static const char LUA_GLOBALS_META_SNAPSHOT_KEY = 0;
+static const char LUA_CHUNK_SNAPSHOT_KEY = 0;
+
+//注册表中保存C++异常的userdata的key, 取其地址. 存在时表示开启了重新抛出
+static const char LUA_CPP_EXCEPTION_KEY = 0;
+
+//注册表中执行预算的userdata的key, 取其地址
+static const char LUA_RUN_BUDGET_KEY = 0;
+
+//-------------------------------------------------------------
+
+namespace Internal
+{
+    int MatchOverload(lua_State * pLua, const OverloadEntry * pEntries, int nCount)
+    {
+        const int nArgs = ::lua_gettop(pLua);
+        for (int i = 0; i < nCount; ++i)
+        {
+            if (pEntries[i].m_nArgs != nArgs)
+            {
+                continue;
+            }
+            bool isMatch = true;
+            for (int k = 0; isMatch && k < nArgs; ++k)
+            {
+                int type = pEntries[i].m_pArgTypes[k];
+                isMatch = (type == LUA_TNONE) || (type == ::lua_type(pLua, k + 1));
+            }
+            if (isMatch)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    static void AddOverloadTypeName(luaL_Buffer * pBuffer, lua_State * pLua, int type)
+    {
+        ::luaL_addstring(pBuffer, (type == LUA_TNONE) ? "any" : ::lua_typename(pLua, type));
+    }
+
+    int RaiseOverloadError(lua_State * pLua, const OverloadEntry * pEntries, int nCount)
+    {
+        //这里不能有需要析构的C++对象, lua_error会longjmp
+        const int nArgs = ::lua_gettop(pLua);
+        luaL_Buffer buffer;
+        ::luaL_buffinit(pLua, &buffer);
+        ::luaL_addstring(&buffer, "no matching overload for (");
+        for (int k = 1; k <= nArgs; ++k)
+        {
+            if (k > 1)
+            {
+                ::luaL_addstring(&buffer, ", ");
+            }
+            AddOverloadTypeName(&buffer, pLua, ::lua_type(pLua, k));
+        }
+        ::luaL_addstring(&buffer, "), candidates:");
+        for (int i = 0; i < nCount; ++i)
+        {
+            ::luaL_addstring(&buffer, " (");
+            for (int k = 0; k < pEntries[i].m_nArgs; ++k)
+            {
+                if (k > 0)
+                {
+                    ::luaL_addstring(&buffer, ", ");
+                }
+                AddOverloadTypeName(&buffer, pLua, pEntries[i].m_pArgTypes[k]);
+            }
+            luaL_addchar(&buffer, ')');
+        }
+        ::luaL_pushresult(&buffer);
+        return ::lua_error(pLua);
+    }
+
+    struct CppExceptionSlot
+    {
+        std::exception_ptr m_exception;
+    };
+
+    static int CppExceptionSlotGc(lua_State * pLua)
+    {
+        CppExceptionSlot * pSlot = (CppExceptionSlot *)::lua_touserdata(pLua, 1);
+        pSlot->~CppExceptionSlot();
+        return 0;
+    }
+
+    //没有开启重新抛出时返回nullptr, 栈保持不变
+    static CppExceptionSlot * GetCppExceptionSlot(lua_State * pLua)
+    {
+        CppExceptionSlot * pSlot = nullptr;
+        if (LUA_TUSERDATA == ::lua_rawgetp(pLua, LUA_REGISTRYINDEX, &LUA_CPP_EXCEPTION_KEY))
+        {
+            pSlot = (CppExceptionSlot *)::lua_touserdata(pLua, -1);
+        }
+        ::lua_pop(pLua, 1);
+        return pSlot;
+    }
+
+    //复制C字符串, 超出缓冲区时截断
+    static void CopyTruncated(char * pBuffer, size_t nBufferSize, const char * pStr)
+    {
+        size_t nLength = pStr ? std::strlen(pStr) : 0;
+        if (nLength >= nBufferSize)
+        {
+            nLength = nBufferSize - 1;
+        }
+        std::memcpy(pBuffer, pStr, nLength);
+        pBuffer[nLength] = 0;
+    }
+
+    //异常的类型名. GCC/Clang的type_info::name()是修饰过的名字, 还原为源码中的写法; MSVC本身就是可读的
+    static void GetExceptionTypeName(const std::type_info & type, char * pBuffer, size_t nBufferSize)
+    {
+#ifdef __GNUC__
+        int status = 0;
+        char * pDemangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+        if (pDemangled)
+        {
+            CopyTruncated(pBuffer, nBufferSize, pDemangled);
+            std::free(pDemangled);
+            return;
+        }
+#endif
+        CopyTruncated(pBuffer, nBufferSize, type.name());
+    }
+
+    int InvokeCppCallableCatching(lua_State * pLua, int(*pfnInvoke)(lua_State *, void *), void * ppf)
+    {
+        /* catch块中不能抛出lua错误, longjmp会跳过异常对象的析构;
+        先把信息复制出来, 离开catch块再抛出. 这里也不能有需要析构的C++对象.
+        */
+        char szWhat[256];
+        char szType[128];
+        try
+        {
+            return pfnInvoke(pLua, ppf);
+        }
+        catch (const std::exception & e)
+        {
+            GetExceptionTypeName(typeid(e), szType, sizeof(szType));
+            CopyTruncated(szWhat, sizeof(szWhat), e.what());
+            if (CppExceptionSlot * pSlot = GetCppExceptionSlot(pLua))
+            {
+                pSlot->m_exception = std::current_exception();
+            }
+        }
+#ifndef LUA_WRAPPER_LUA_AS_CPP
+        //按C++编译时lua自身的错误也是C++异常, 不能拦截
+        catch (...)
+        {
+            CopyTruncated(szType, sizeof(szType), "unknown");
+            szWhat[0] = 0;
+            if (CppExceptionSlot * pSlot = GetCppExceptionSlot(pLua))
+            {
+                pSlot->m_exception = std::current_exception();
+            }
+        }
+#endif
+        ::lua_pushfstring(pLua, "C++ exception (%s): %s", szType, szWhat);
+        return ::lua_error(pLua);
+    }
+
+    void ResetCppException(lua_State * pLua)
+    {
+        if (CppExceptionSlot * pSlot = GetCppExceptionSlot(pLua))
+        {
+            pSlot->m_exception = nullptr;
+        }
+    }
+
+    void RethrowCppException(lua_State * pLua)
+    {
+        CppExceptionSlot * pSlot = GetCppExceptionSlot(pLua);
+        if (pSlot && pSlot->m_exception)
+        {
+            std::exception_ptr exception = pSlot->m_exception;
+            pSlot->m_exception = nullptr;
+            ::lua_pop(pLua, 1);
+            std::rethrow_exception(exception);
+        }
+    }
+
+    struct LuaRunBudget
+    {
+        unsigned long long m_nMaxInstructions;
+        unsigned int m_nTimeoutMs;
+        //钩子每隔多少条指令调用一次
+        int m_nHookCount;
+        //只在最外层的run、call期间有效
+        bool m_bActive;
+        unsigned long long m_nUsedInstructions;
+        std::chrono::steady_clock::time_point m_deadline;
+    };
+
+    static LuaRunBudget * GetLuaRunBudget(lua_State * pLua)
+    {
+        ::lua_rawgetp(pLua, LUA_REGISTRYINDEX, &LUA_RUN_BUDGET_KEY);
+        LuaRunBudget * pBudget = (LuaRunBudget *)::lua_touserdata(pLua, -1);
+        ::lua_pop(pLua, 1);
+        return pBudget;
+    }
+
+    static void LuaRunBudgetHook(lua_State * pLua, lua_Debug *)
+    {
+        //这里不能有需要析构的C++对象, luaL_error会longjmp
+        LuaRunBudget * pBudget = GetLuaRunBudget(pLua);
+        if (!pBudget)
+        {
+            return;
+        }
+        const int nHookCount = ::lua_gethookcount(pLua);
+        if (!pBudget->m_bActive)
+        {
+            if (nHookCount != pBudget->m_nHookCount)
+            {
+                ::lua_sethook(pLua, LuaRunBudgetHook, LUA_MASKCOUNT, pBudget->m_nHookCount);
+            }
+            return;
+        }
+        pBudget->m_nUsedInstructions += (unsigned int)nHookCount;
+        if ((pBudget->m_nMaxInstructions != 0 && pBudget->m_nUsedInstructions >= pBudget->m_nMaxInstructions)
+            || (pBudget->m_nTimeoutMs != 0 && std::chrono::steady_clock::now() >= pBudget->m_deadline))
+        {
+            //之后每条指令都出错, 脚本用pcall捕获后不能继续执行
+            if (nHookCount != 1)
+            {
+                ::lua_sethook(pLua, LuaRunBudgetHook, LUA_MASKCOUNT, 1);
+            }
+            ::luaL_error(pLua, "script budget exceeded");
+        }
+        else if (nHookCount != pBudget->m_nHookCount)
+        {
+            ::lua_sethook(pLua, LuaRunBudgetHook, LUA_MASKCOUNT, pBudget->m_nHookCount);
+        }
+    }
+
+    LuaRunBudgetScope::LuaRunBudgetScope(lua_State * pLua)
+        : m_pBudget(nullptr)
+    {
+        LuaRunBudget * pBudget = GetLuaRunBudget(pLua);
+        if (pBudget && !pBudget->m_bActive)
+        {
+            pBudget->m_bActive = true;
+            pBudget->m_nUsedInstructions = 0;
+            pBudget->m_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(pBudget->m_nTimeoutMs);
+            m_pBudget = pBudget;
+        }
+    }
+
+    LuaRunBudgetScope::~LuaRunBudgetScope()
+    {
+        if (m_pBudget)
+        {
+            ((LuaRunBudget *)m_pBudget)->m_bActive = false;
+        }
+    }
+
+    void CheckLuaArgs(lua_State * pLua, const LuaArgCheckFunc * pChecks)
+    {
+        //这里不能有需要析构的C++对象, luaL_argerror会longjmp
+        for (int i = 0; pChecks[i]; ++i)
+        {
+            const char * pExpected = pChecks[i](pLua, i + 1);
+            if (pExpected)
+            {
+                ::luaL_argerror(pLua, i + 1,
+                    ::lua_pushfstring(pLua, "%s expected, got %s", pExpected, luaL_typename(pLua, i + 1)));
+            }
+        }
+    }
+}
 
 //-------------------------------------------------------------
 
@@ -15,16 +299,17 @@ lua_state_wrapper::lua_state_wrapper()
 lua_state_wrapper::lua_state_wrapper(lua_state_wrapper&& lua2)
 {
     m_pLuaState = lua2.m_pLuaState;
+    m_chunk = lua2.m_chunk;
     lua2.m_pLuaState = nullptr;
+    lua2.m_chunk = lua_function_ref();
 }
 
 lua_state_wrapper& lua_state_wrapper::operator=(lua_state_wrapper&& lua2)
 {
     if (this != &lua2)
     {
-        lua_State* p = m_pLuaState;
-        m_pLuaState = lua2.m_pLuaState;
-        lua2.m_pLuaState = p;
+        std::swap(m_pLuaState, lua2.m_pLuaState);
+        std::swap(m_chunk, lua2.m_chunk);
     }
     return *this;
 }
@@ -53,12 +338,63 @@ bool lua_state_wrapper::create()
     return true;
 }
 
+namespace Internal
+{
+    //同lauxlib中luaL_newstate设置的panic函数
+    static int LuaPanic(lua_State * pLua)
+    {
+        lua_writestringerror("PANIC: unprotected error in call to Lua API (%s)\n", ::lua_tostring(pLua, -1));
+        return 0;
+    }
+
+    static int LuaOpenLibs(lua_State * pLua)
+    {
+        ::luaL_openlibs(pLua);
+        return 0;
+    }
+}
+
+bool lua_state_wrapper::create(lua_Alloc pfnAlloc, void * pAllocUd)
+{
+    assert(!m_pLuaState);
+    assert(pfnAlloc);
+    if (m_pLuaState)
+    {
+        return true;
+    }
+    if (!pfnAlloc)
+    {
+        return false;
+    }
+    m_pLuaState = ::lua_newstate(pfnAlloc, pAllocUd);
+    if (!m_pLuaState)
+    {
+        return false;
+    }
+    ::lua_atpanic(m_pLuaState, Internal::LuaPanic);
+    //内存上限可能不够打开标准库, 在保护模式中执行. 压入没有upvalue的C函数不分配内存
+    ::lua_pushcfunction(m_pLuaState, Internal::LuaOpenLibs);
+    if (::lua_pcall(m_pLuaState, 0, 0, 0) != LUA_OK)
+    {
+        ::lua_close(m_pLuaState);
+        m_pLuaState = nullptr;
+        return false;
+    }
+    return true;
+}
+
+bool lua_state_wrapper::create(lua_memory_quota & quota)
+{
+    return create(&lua_memory_quota::alloc, &quota);
+}
+
 void lua_state_wrapper::close()
 {
     if (m_pLuaState)
     {
         ::lua_close(m_pLuaState);
         m_pLuaState = nullptr;
+        m_chunk = lua_function_ref();
     }
 }
 
@@ -66,12 +402,14 @@ void lua_state_wrapper::attach(lua_State * pState)
 {
     assert(!m_pLuaState);
     m_pLuaState = pState;
+    m_chunk = lua_function_ref();
 }
 
 lua_State * lua_state_wrapper::detach()
 {
     auto p = m_pLuaState;
     m_pLuaState = nullptr;
+    m_chunk = lua_function_ref();
     return p;
 }
 
@@ -160,27 +498,14 @@ bool lua_state_wrapper::do_lua_string(const wchar_t * pString)
     }
 }
 
-bool lua_state_wrapper::load_lua_file(const char * pFileName)
+bool lua_state_wrapper::load_lua_file(const char * pFileName, lua_chunk_cache * pCache)
 {
-    assert(m_pLuaState);
-    auto err = LUA_ERRERR;
-    if (pFileName && *pFileName && m_pLuaState)
-    {
-        std::string luaStr = std::string(LUA_CHUNK_FUNC_NAME) + R"*( = loadfile([=====[)*" + pFileName + R"*(]=====]))*";
-        if (do_lua_string(luaStr.c_str()))
-        {
-            lua_stack_guard stateGuard(m_pLuaState);
-            if (LUA_TFUNCTION == ::lua_getglobal(m_pLuaState, LUA_CHUNK_FUNC_NAME))
-            {
-                err = LUA_OK;
-            }
-        }
-    }
-    assert(err == LUA_OK);
-    return (err == LUA_OK);
+    bool bOk = set_loaded_chunk(load_chunk_file(pFileName, pCache));
+    assert(bOk);
+    return bOk;
 }
 
-bool lua_state_wrapper::load_lua_file(const wchar_t * pFileName)
+bool lua_state_wrapper::load_lua_file(const wchar_t * pFileName, lua_chunk_cache * pCache)
 {
     try
     {
@@ -190,7 +515,7 @@ bool lua_state_wrapper::load_lua_file(const wchar_t * pFileName)
         auto & fct = std::use_facet<std::codecvt_utf16<wchar_t> >(std::locale{});
         std::wstring_convert<std::remove_reference_t<decltype(fct)> > cvt(&fct);
 #endif
-        return load_lua_file(cvt.to_bytes(pFileName).c_str());
+        return load_lua_file(cvt.to_bytes(pFileName).c_str(), pCache);
     }
     catch (...)
     {
@@ -201,22 +526,20 @@ bool lua_state_wrapper::load_lua_file(const wchar_t * pFileName)
 
 bool lua_state_wrapper::load_lua_string(const char * pString)
 {
-    assert(m_pLuaState);
-    auto err = LUA_ERRERR;
-    if (pString && *pString && m_pLuaState)
+    assert(pString);
+    if (!pString)
     {
-        std::string luaStr = std::string(LUA_CHUNK_FUNC_NAME) + R"*( = load([=====[)*" + pString + R"*(]=====]))*";
-        if (do_lua_string(luaStr.c_str()))
-        {
-            lua_stack_guard stateGuard(m_pLuaState);
-            if (LUA_TFUNCTION == ::lua_getglobal(m_pLuaState, LUA_CHUNK_FUNC_NAME))
-            {
-                err = LUA_OK;
-            }
-        }
+        return false;
     }
-    assert(err == LUA_OK);
-    return (err == LUA_OK);
+    //与luaL_loadstring相同, 脚本本身作为名字
+    return load_lua_string(pString, std::strlen(pString), pString);
+}
+
+bool lua_state_wrapper::load_lua_string(const char * pBuffer, size_t len, const char * pChunkName)
+{
+    bool bOk = set_loaded_chunk(load_chunk_string(pBuffer, len, pChunkName));
+    assert(bOk);
+    return bOk;
 }
 
 bool lua_state_wrapper::load_lua_string(const wchar_t * pString)
@@ -239,19 +562,139 @@ bool lua_state_wrapper::load_lua_string(const wchar_t * pString)
 }
 
 bool lua_state_wrapper::run()
+{
+    return run(m_chunk);
+}
+
+lua_function_ref lua_state_wrapper::load_chunk_file(const char * pFileName, lua_chunk_cache * pCache)
 {
     assert(m_pLuaState);
-    if (m_pLuaState)
+    if (pFileName && *pFileName && m_pLuaState)
     {
-        lua_stack_guard stateGuard(m_pLuaState);
-        if (LUA_TFUNCTION == ::lua_getglobal(m_pLuaState, LUA_CHUNK_FUNC_NAME))
+        //直接编译文件(或从缓存中加载字节码), 失败时错误信息留在栈上
+        auto err = pCache ? pCache->load_file(m_pLuaState, pFileName) : ::luaL_loadfile(m_pLuaState, pFileName);
+        if (err == LUA_OK)
         {
-            return (0 == ::lua_pcall(m_pLuaState, 0, LUA_MULTRET, 0));
+            return lua_function_ref(::luaL_ref(m_pLuaState, LUA_REGISTRYINDEX));
         }
     }
+    return lua_function_ref();
+}
+
+lua_function_ref lua_state_wrapper::load_chunk_string(const char * pBuffer, size_t len, const char * pChunkName)
+{
+    assert(m_pLuaState);
+    if (pBuffer && m_pLuaState)
+    {
+        //失败时错误信息留在栈上
+        auto err = ::luaL_loadbufferx(m_pLuaState, pBuffer, len, pChunkName ? pChunkName : "=(load)", nullptr);
+        if (err == LUA_OK)
+        {
+            return lua_function_ref(::luaL_ref(m_pLuaState, LUA_REGISTRYINDEX));
+        }
+    }
+    return lua_function_ref();
+}
+
+void lua_state_wrapper::unload_chunk(lua_function_ref & chunk)
+{
+    release_function_ref(chunk);
+}
+
+lua_function_ref lua_state_wrapper::get_function_ref(const char * pFuncName)
+{
+    assert(m_pLuaState);
+    if (m_pLuaState && pFuncName)
+    {
+        lua_stack_guard_checker check(m_pLuaState);
+        if (LUA_TFUNCTION == ::lua_getglobal(m_pLuaState, pFuncName))
+        {
+            return lua_function_ref(::luaL_ref(m_pLuaState, LUA_REGISTRYINDEX));
+        }
+        ::lua_pop(m_pLuaState, 1);
+    }
+    return lua_function_ref();
+}
+
+void lua_state_wrapper::release_function_ref(lua_function_ref & func)
+{
+    if (m_pLuaState && func.valid())
+    {
+        ::luaL_unref(m_pLuaState, LUA_REGISTRYINDEX, func.get());
+    }
+    func = lua_function_ref();
+}
+
+bool lua_state_wrapper::set_loaded_chunk(lua_function_ref chunk)
+{
+    if (chunk.valid())
+    {
+        unload_chunk(m_chunk);
+        m_chunk = chunk;
+        return true;
+    }
     return false;
 }
 
+void lua_state_wrapper::set_rethrow_cpp_exception(bool bRethrow)
+{
+    assert(m_pLuaState);
+    if (!m_pLuaState)
+    {
+        return;
+    }
+    lua_stack_guard_checker check(m_pLuaState);
+    if (!bRethrow)
+    {
+        ::lua_pushnil(m_pLuaState);
+        ::lua_rawsetp(m_pLuaState, LUA_REGISTRYINDEX, &LUA_CPP_EXCEPTION_KEY);
+    }
+    else if (!Internal::GetCppExceptionSlot(m_pLuaState))
+    {
+        void * pSlot = ::lua_newuserdata(m_pLuaState, sizeof(Internal::CppExceptionSlot));
+        ::new (pSlot) Internal::CppExceptionSlot();
+        ::lua_createtable(m_pLuaState, 0, 1);
+        ::lua_pushcfunction(m_pLuaState, Internal::CppExceptionSlotGc);
+        ::lua_setfield(m_pLuaState, -2, "__gc");
+        ::lua_setmetatable(m_pLuaState, -2);
+        ::lua_rawsetp(m_pLuaState, LUA_REGISTRYINDEX, &LUA_CPP_EXCEPTION_KEY);
+    }
+}
+
+void lua_state_wrapper::set_run_budget(unsigned long long nMaxInstructions, unsigned int nTimeoutMs)
+{
+    assert(m_pLuaState);
+    if (!m_pLuaState)
+    {
+        return;
+    }
+    lua_stack_guard_checker check(m_pLuaState);
+    Internal::LuaRunBudget * pBudget = Internal::GetLuaRunBudget(m_pLuaState);
+    if (nMaxInstructions == 0 && nTimeoutMs == 0)
+    {
+        //userdata保留在注册表中, 执行中的run、call还在使用
+        if (pBudget)
+        {
+            pBudget->m_nMaxInstructions = 0;
+            pBudget->m_nTimeoutMs = 0;
+            ::lua_sethook(m_pLuaState, nullptr, 0, 0);
+        }
+        return;
+    }
+    if (!pBudget)
+    {
+        pBudget = (Internal::LuaRunBudget *)::lua_newuserdata(m_pLuaState, sizeof(Internal::LuaRunBudget));
+        ::new (pBudget) Internal::LuaRunBudget();
+        ::lua_rawsetp(m_pLuaState, LUA_REGISTRYINDEX, &LUA_RUN_BUDGET_KEY);
+    }
+    const int nDefaultHookCount = 1000;
+    pBudget->m_nMaxInstructions = nMaxInstructions;
+    pBudget->m_nTimeoutMs = nTimeoutMs;
+    pBudget->m_nHookCount = (nMaxInstructions != 0 && nMaxInstructions < (unsigned long long)nDefaultHookCount)
+        ? (int)nMaxInstructions : nDefaultHookCount;
+    ::lua_sethook(m_pLuaState, Internal::LuaRunBudgetHook, LUA_MASKCOUNT, pBudget->m_nHookCount);
+}
+
 std::string lua_state_wrapper::get_error_msg()
 {
     if (!m_pLuaState)
@@ -289,4 +732,109 @@ size_t lua_state_wrapper::get_size(int index)
     return 0;
 }
 
+bool lua_state_wrapper::snapshot_globals()
+{
+    assert(m_pLuaState);
+    if (!m_pLuaState)
+    {
+        return false;
+    }
+    lua_stack_guard_checker check(m_pLuaState);
+    ::lua_rawgeti(m_pLuaState, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    const int globalsIndex = ::lua_gettop(m_pLuaState);
+    ::lua_newtable(m_pLuaState);
+    ::lua_pushnil(m_pLuaState);
+    while (::lua_next(m_pLuaState, globalsIndex) != 0)
+    {
+        ::lua_pushvalue(m_pLuaState, -2);
+        ::lua_insert(m_pLuaState, -2);
+        ::lua_rawset(m_pLuaState, globalsIndex + 1);
+    }
+    ::lua_rawsetp(m_pLuaState, LUA_REGISTRYINDEX, &LUA_GLOBALS_SNAPSHOT_KEY);
+    if (!::lua_getmetatable(m_pLuaState, globalsIndex))
+    {
+        ::lua_pushnil(m_pLuaState);
+    }
+    ::lua_rawsetp(m_pLuaState, LUA_REGISTRYINDEX, &LUA_GLOBALS_META_SNAPSHOT_KEY);
+    ::lua_pop(m_pLuaState, 1);
+
+    //保存函数本身而不是引用, 之后加载的脚本释放m_chunk时不影响快照
+    if (m_chunk.valid())
+    {
+        ::lua_rawgeti(m_pLuaState, LUA_REGISTRYINDEX, m_chunk.get());
+    }
+    else
+    {
+        ::lua_pushnil(m_pLuaState);
+    }
+    ::lua_rawsetp(m_pLuaState, LUA_REGISTRYINDEX, &LUA_CHUNK_SNAPSHOT_KEY);
+    return true;
+}
+
+bool lua_state_wrapper::reset_globals()
+{
+    assert(m_pLuaState);
+    if (!m_pLuaState)
+    {
+        return false;
+    }
+    ::lua_settop(m_pLuaState, 0);
+    if (LUA_TTABLE != ::lua_rawgetp(m_pLuaState, LUA_REGISTRYINDEX, &LUA_GLOBALS_SNAPSHOT_KEY))
+    {
+        ::lua_settop(m_pLuaState, 0);
+        return false;
+    }
+    const int snapshotIndex = 1;
+    const int globalsIndex = 2;
+    ::lua_rawgeti(m_pLuaState, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+
+    //删除快照之后新增的全局变量, 遍历时把已有的字段置nil是允许的
+    ::lua_pushnil(m_pLuaState);
+    while (::lua_next(m_pLuaState, globalsIndex) != 0)
+    {
+        ::lua_pop(m_pLuaState, 1);
+        ::lua_pushvalue(m_pLuaState, -1);
+        if (LUA_TNIL == ::lua_rawget(m_pLuaState, snapshotIndex))
+        {
+            ::lua_pushvalue(m_pLuaState, -2);
+            ::lua_pushnil(m_pLuaState);
+            ::lua_rawset(m_pLuaState, globalsIndex);
+        }
+        ::lua_pop(m_pLuaState, 1);
+    }
+
+    //还原被修改的全局变量
+    ::lua_pushnil(m_pLuaState);
+    while (::lua_next(m_pLuaState, snapshotIndex) != 0)
+    {
+        ::lua_pushvalue(m_pLuaState, -2);
+        ::lua_insert(m_pLuaState, -2);
+        ::lua_rawset(m_pLuaState, globalsIndex);
+    }
+
+    //还原_G的元表, 脚本用setmetatable(_G, ...)设置的钩子不能留给下一个使用者
+    ::lua_rawgetp(m_pLuaState, LUA_REGISTRYINDEX, &LUA_GLOBALS_META_SNAPSHOT_KEY);
+    ::lua_setmetatable(m_pLuaState, globalsIndex);
+
+    //快照之后load_lua_xxx加载的脚本要卸载, 否则下一个使用者的run会执行它
+    ::lua_rawgetp(m_pLuaState, LUA_REGISTRYINDEX, &LUA_CHUNK_SNAPSHOT_KEY);
+    bool bSame = false;
+    if (m_chunk.valid())
+    {
+        ::lua_rawgeti(m_pLuaState, LUA_REGISTRYINDEX, m_chunk.get());
+        bSame = (::lua_rawequal(m_pLuaState, -1, -2) != 0);
+        ::lua_pop(m_pLuaState, 1);
+    }
+    if (!bSame)
+    {
+        unload_chunk(m_chunk);
+        if (::lua_type(m_pLuaState, -1) == LUA_TFUNCTION)
+        {
+            m_chunk = lua_function_ref(::luaL_ref(m_pLuaState, LUA_REGISTRYINDEX));
+        }
+    }
+    ::lua_settop(m_pLuaState, 0);
+    return true;
+}
+
 SHARELIB_END_NAMESPACE
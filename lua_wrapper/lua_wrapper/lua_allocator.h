@@ -0,0 +1,178 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include "MacroDefBase.h"
+#include "lua_wrapper_base.h"
+
+SHARELIB_BEGIN_NAMESPACE
+
+//----lua_State的内存配额-------------------------------------------------------------
+
+/* 统计并限制lua_State使用的内存, 用lua_state_wrapper::create(quota)创建lua_State.
+1. 超出上限的分配返回失败, lua先做一次完整的垃圾回收再重试, 仍然失败时抛出LUA_ERRMEM("not enough memory"),
+   由run、call等受保护调用返回失败, 不会影响其他lua_State;
+2. 释放和缩小内存总是成功, 修改上限不影响已分配的内存;
+3. 计数是原子操作, 可以在其他线程中读取; 多个lua_State共用一个配额时限制它们的总和;
+4. 必须比使用它的lua_State后销毁.
+*/
+class lua_memory_quota
+{
+    SHARELIB_DISABLE_COPY_CLASS(lua_memory_quota);
+public:
+    /**
+    @param[in] nLimitBytes 内存上限(字节), 0表示不限制
+    @param[in] pfnAlloc 实际分配内存的函数, 规则同lua_Alloc; nullptr时使用realloc和free
+    @param[in] pAllocUd 传给pfnAlloc的参数
+    */
+    explicit lua_memory_quota(size_t nLimitBytes = 0, lua_Alloc pfnAlloc = nullptr, void * pAllocUd = nullptr);
+
+    //修改上限, 0表示不限制
+    void set_limit(size_t nLimitBytes);
+    size_t get_limit() const;
+
+    //当前使用的字节数
+    size_t get_used() const;
+
+    //使用量的最大值
+    size_t get_peak() const;
+
+    //把最大值重置为当前使用量, 用于分段统计
+    void reset_peak();
+
+    //因超出上限而失败的分配次数
+    size_t get_failed_count() const;
+
+    //传给lua_newstate的分配函数, ud是lua_memory_quota对象
+    static void * alloc(void * ud, void * ptr, size_t osize, size_t nsize);
+
+private:
+    std::atomic<size_t> m_nLimit;
+    std::atomic<size_t> m_nUsed;
+    std::atomic<size_t> m_nPeak;
+    std::atomic<size_t> m_nFailed;
+    lua_Alloc m_pfnAlloc;
+    void * m_pAllocUd;
+};
+
+//----按大小分级的slab分配器-------------------------------------------------------------
+
+/* lua的对象(字符串、table、闭包、upvalue、CallInfo等)大多是几十字节的小块, 频繁分配释放.
+用lua_state_wrapper::create(&lua_slab_allocator::alloc, &slab)创建lua_State, 代替逐个malloc:
+1. 不超过256字节的块按8字节分级, 每级从slab(默认16KB的大块, 按自身大小对齐)中切分, 一个slab只属于一级;
+2. 更大的块直接用realloc和free, 容量按8字节取整;
+3. 释放的小块放回所在slab的空闲链表, slab中的块全部释放后归还给系统(保留一个空的slab备用);
+   仍有块在使用的slab不能归还, 也不能给其它级别使用, 这部分是碎片;
+4. 不是线程安全的, 一个分配器只给一个lua_State使用(同一时刻只有一个线程执行它), 必须比lua_State后销毁;
+5. 可以作为lua_memory_quota的底层分配函数, 但配额统计的是lua请求的字节数, 不包括slab中的空闲块和取整浪费,
+   实际占用的内存(get_stats().m_nSlabBytes + m_nLargeBytes)可能超出配额的上限.
+*/
+class lua_slab_allocator
+{
+    SHARELIB_DISABLE_COPY_CLASS(lua_slab_allocator);
+public:
+    //单级小块的统计
+    struct class_stats
+    {
+        size_t m_nBlockSize;
+        //正在使用的块数
+        size_t m_nUsedBlocks;
+        //已从slab中切分出的块数, 包括空闲的
+        size_t m_nTotalBlocks;
+    };
+
+    struct stats
+    {
+        //从系统分配的slab总字节数
+        size_t m_nSlabBytes;
+        //正在使用的小块按级别取整后的字节数, 与m_nSlabBytes之比是slab的占用率
+        size_t m_nSmallBlockBytes;
+        //小块实际请求的字节数, 与m_nSmallBlockBytes的差是取整浪费的内存
+        size_t m_nSmallRequestedBytes;
+        //直接用realloc分配的大块的字节数和个数
+        size_t m_nLargeBytes;
+        size_t m_nLargeCount;
+
+        //slab中没有被有效使用的比例(空闲块与取整浪费), 0~1
+        double fragmentation() const;
+    };
+
+    /**
+    @param[in] nSlabBytes 每个slab的大小, 必须是2的幂, 不能小于最大的小块
+    */
+    explicit lua_slab_allocator(size_t nSlabBytes = 16 * 1024);
+    ~lua_slab_allocator();
+
+    stats get_stats() const;
+
+    //小块的级数
+    size_t get_class_count() const;
+    class_stats get_class_stats(size_t index) const;
+
+    //传给lua_newstate的分配函数, ud是lua_slab_allocator对象
+    static void * alloc(void * ud, void * ptr, size_t osize, size_t nsize);
+
+private:
+    //slab的头部, 位于slab的开始处. 块的地址按slab大小向下取整就得到所在的slab
+    struct slab_header
+    {
+        //同级slab的双向链表, 有空闲块的在前, 已满的在后
+        slab_header * m_pPrev;
+        slab_header * m_pNext;
+        //空闲块的链表, 块的前几个字节保存下一个空闲块
+        void * m_pFreeList;
+        //还没有切分的部分
+        char * m_pBump;
+        size_t m_nUsedBlocks;
+        size_t m_nClass;
+    };
+
+    struct size_class
+    {
+        slab_header * m_pFirst;
+        slab_header * m_pLast;
+        size_t m_nUsedBlocks;
+        size_t m_nTotalBlocks;
+    };
+
+    enum
+    {
+        SLAB_GRANULARITY = 8,
+        SLAB_MAX_SMALL_SIZE = 256,
+        SLAB_CLASS_COUNT = SLAB_MAX_SMALL_SIZE / SLAB_GRANULARITY,
+        SLAB_HEADER_SIZE = (sizeof(slab_header) + SLAB_GRANULARITY - 1) / SLAB_GRANULARITY * SLAB_GRANULARITY,
+    };
+
+    static size_t class_index(size_t nSize)
+    {
+        return (nSize - 1) / SLAB_GRANULARITY;
+    }
+
+    bool is_slab_full(const slab_header * pSlab) const;
+    void unlink_slab(slab_header * pSlab);
+    void link_slab_front(slab_header * pSlab);
+    void link_slab_back(slab_header * pSlab);
+    slab_header * new_slab(size_t index);
+    void delete_slab(slab_header * pSlab);
+
+    void * alloc_small(size_t nSize);
+    void free_small(void * ptr, size_t nSize);
+    void * realloc_large(void * ptr, size_t osize, size_t nsize);
+    void free_block(void * ptr, size_t nSize, bool isSmall);
+    bool remove_demoted(void * ptr);
+
+    const size_t m_nSlabBytes;
+    size_class m_classes[SLAB_CLASS_COUNT];
+    //全部块都已释放的slab, 留一个备用, 避免在满与空之间反复分配释放
+    slab_header * m_pSpareSlab;
+    size_t m_nSlabCount;
+    size_t m_nSmallRequestedBytes;
+    size_t m_nLargeBytes;
+    size_t m_nLargeCount;
+    /* 大块缩小为小块而又无法分配slab时保留原来的大块, 之后lua按小块的大小释放它. 这些块用链表记录,
+    下一个块的指针保存在块的第SLAB_MAX_SMALL_SIZE字节处(大块的容量至少是SLAB_MAX_SMALL_SIZE + 8)
+    */
+    void * m_pDemoted;
+};
+
+SHARELIB_END_NAMESPACE
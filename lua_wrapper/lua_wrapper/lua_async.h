@@ -0,0 +1,129 @@
+﻿#pragma once
+
+#include <chrono>
+#include <future>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "MacroDefBase.h"
+#include "lua_wrapper.h"
+
+SHARELIB_BEGIN_NAMESPACE
+
+//----异步C++调用------------------------------------------------------------
+
+/* 返回std::future或std::shared_future的C++调用, 注册方式与普通调用相同(需要包含本头文件):
+1. 脚本在协程中调用时, 协程挂起(lua_yieldk), lua_resume返回LUA_YIELD, 线程不被阻塞;
+2. 宿主用lua_async_pending/lua_async_ready查询, 结果就绪后用lua_async_resume恢复协程,
+   脚本中得到future的值, future::get抛出的异常转换为lua错误;
+3. 不在协程中调用(如主线程lua_pcall)时, 同步等待结果;
+4. 挂起期间future保存在协程栈上的userdata中, 协程被回收时一起析构;
+5. 挂起交给直接恢复这个协程的一方: 在脚本中用coroutine.resume/wrap运行的协程里调用时, 挂起到该脚本
+   (coroutine.resume返回true和一个异步操作的userdata), 而不是宿主, 脚本需要自己再次resume(会阻塞等待结果).
+一个lua_State及其协程仍然只能在一个线程中使用, 多个协程可以同时挂起, 由少量线程轮流恢复.
+*/
+
+/** 协程是否因异步C++调用而挂起
+@param[in] co lua_resume返回LUA_YIELD的协程
+*/
+bool lua_async_pending(lua_State * co);
+
+//协程因异步C++调用而挂起, 且结果已经就绪
+bool lua_async_ready(lua_State * co);
+
+/** 恢复因异步C++调用而挂起的协程, 结果未就绪时阻塞等待
+@param[in,out] co 挂起的协程
+@param[in] from 调用者, 可以为nullptr
+@return lua_resume的返回值, 协程不是因异步调用挂起时返回LUA_ERRRUN
+*/
+int lua_async_resume(lua_State * co, lua_State * from);
+
+namespace Internal
+{
+    //挂起期间保存的异步操作, 构造在userdata中
+    struct LuaAsyncOperation
+    {
+        virtual ~LuaAsyncOperation()
+        {
+        }
+
+        virtual bool IsReady() = 0;
+
+        //压入结果, 返回个数
+        virtual int PushResult(lua_State * pLua) = 0;
+    };
+
+    template<class _Future, class R = decltype(std::declval<_Future &>().get())>
+    struct LuaFutureOperation
+        : public LuaAsyncOperation
+    {
+        explicit LuaFutureOperation(_Future && future)
+            : m_future(std::move(future))
+        {
+        }
+
+        bool IsReady() override
+        {
+            //无效的future在get时抛出异常
+            return !m_future.valid()
+                || (m_future.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+        }
+
+        int PushResult(lua_State * pLua) override
+        {
+            return PushResultImpl(pLua, std::is_void<R>());
+        }
+
+    private:
+        int PushResultImpl(lua_State * pLua, std::false_type)
+        {
+            return LuaReturnValue<std::decay_t<R> >::Push(pLua, m_future.get());
+        }
+
+        int PushResultImpl(lua_State *, std::true_type)
+        {
+            m_future.get();
+            return 0;
+        }
+
+        _Future m_future;
+    };
+
+    /** 创建异步操作的userdata, 压入栈顶, 还没有关联元表
+    @return 对象的内存
+    */
+    void * LuaAsyncNewOperation(lua_State * pLua, size_t size);
+
+    //对象构造成功后关联元表, 垃圾回收时析构
+    void LuaAsyncAttachOperation(lua_State * pLua);
+
+    template<class _Future>
+    struct LuaFutureReturnValue
+    {
+        static int Push(lua_State * pLua, _Future && future)
+        {
+            using operation_t = LuaFutureOperation<_Future>;
+            static_assert(std::alignment_of<operation_t>::value <= std::alignment_of<LuaMaxAlign>::value,
+                "over-aligned future is not supported");
+            ::luaL_checkstack(pLua, 3, "too many results");
+            void * pOperation = LuaAsyncNewOperation(pLua, sizeof(operation_t));
+            ::new (pOperation) operation_t(std::move(future));
+            LuaAsyncAttachOperation(pLua);
+            return LUA_CPP_CALL_YIELD;
+        }
+    };
+
+    template<class R>
+    struct LuaReturnValue<std::future<R> >
+        : public LuaFutureReturnValue<std::future<R> >
+    {
+    };
+
+    template<class R>
+    struct LuaReturnValue<std::shared_future<R> >
+        : public LuaFutureReturnValue<std::shared_future<R> >
+    {
+    };
+}
+
+SHARELIB_END_NAMESPACE
@@ -0,0 +1,70 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "MacroDefBase.h"
+#include "lua_wrapper_base.h"
+
+SHARELIB_BEGIN_NAMESPACE
+
+//----编译后的lua脚本缓存-------------------------------------------------------------
+
+/* 同一个脚本需要加载到大量lua_State时, 只编译一次: 首次加载时编译, 用lua_dump把字节码保存在内存中,
+之后的加载直接用lua_load从字节码恢复, 跳过词法分析和语法分析.
+1. 以文件路径为key, 文件的修改时间和大小都没变时直接命中, 不再读取文件;
+   否则重新读取文件计算内容hash, 内容相同仍然命中, 不同则重新编译;
+   修改时间只精确到秒, 修改时间不早于上次读取文件的那一秒时也重新计算hash, 避免同一秒内的修改被忽略;
+2. 可以指定一个目录, 编译结果同时写入该目录(以路径和内容的hash命名), 进程重启后仍可复用,
+   字节码与当前lua版本不兼容时自动重新编译;
+3. 线程安全, 一个缓存对象可以被多个线程中的lua_State共用, 但必须比使用它的lua_State后销毁.
+*/
+class lua_chunk_cache
+{
+    SHARELIB_DISABLE_COPY_CLASS(lua_chunk_cache);
+public:
+    lua_chunk_cache();
+
+    /**
+    @param[in] pSpillDir 字节码写入的磁盘目录, 必须已存在; nullptr或空字符串表示只缓存在内存中
+    */
+    explicit lua_chunk_cache(const char * pSpillDir);
+
+    /** 加载脚本文件, 行为与luaL_loadfile相同
+    @param[in,out] pLua
+    @param[in] pFileName 文件路径
+    @return LUA_OK表示成功, 编译好的lua函数压入栈顶; 失败时栈顶是错误信息
+    */
+    int load_file(lua_State * pLua, const char * pFileName);
+
+    //清空内存中的缓存, 不影响磁盘上的文件
+    void clear();
+
+    //内存中缓存的脚本个数
+    size_t size() const;
+
+private:
+    struct chunk_entry
+    {
+        long long m_mtime;
+        long long m_fileSize;
+        long long m_readTime; //读取文件时的时间(秒)
+        uint64_t m_hash;
+        std::string m_bytecode;
+    };
+    using entry_ptr = std::shared_ptr<const chunk_entry>;
+
+    entry_ptr find(const std::string & fileName, long long mtime, long long fileSize);
+    entry_ptr compile(lua_State * pLua, const std::string & fileName, const std::string & chunkName,
+                      long long mtime, long long fileSize, int & err);
+    bool read_spill(const std::string & spillName, std::string & bytecode);
+    void write_spill(const std::string & spillName, const std::string & bytecode);
+
+    mutable std::mutex m_lock;
+    std::unordered_map<std::string, entry_ptr> m_entries;
+    const std::string m_spillDir;
+};
+
+SHARELIB_END_NAMESPACE
@@ -0,0 +1,588 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "MacroDefBase.h"
+#include "lua_iostream.h"
+#include "MetaUtility.h"
+
+SHARELIB_BEGIN_NAMESPACE
+
+//----C++类绑定到lua----------------------------------------------------------
+
+/* 绑定到lua的C++类, 对象在lua中是full userdata, 每个类一个元表:
+1. 用DECLARE_LUA_CLASS_IMPLEMENT或DECLARE_LUA_CLASS_BASES_IMPLEMENT在全局命名空间中声明,
+   声明之后该类的指针和值都按userdata传递;
+2. 用BEGIN_LUA_CLASS_MAP_IMPLEMENT等宏生成注册函数, 对每个lua_State调用一次, 基类要先于派生类注册;
+3. lua中用 obj:Method(...) 调用成员函数, 基类的成员函数在注册时复制到派生类的方法表中,
+   查找只有一次, 调用时对象指针按实际类型查偏移表转换为基类指针(编译期生成, 不用dynamic_cast), 不支持虚继承;
+4. 值传递(函数返回值、Class.new创建)的对象直接构造在userdata中, 由lua垃圾回收时析构;
+   指针传递的对象只是引用, lua不管理其生命期;
+5. 未在当前lua_State中注册的类, 指针仍按lightuserdata传递; lightuserdata传给绑定类的指针参数时不做类型检查;
+6. 成员变量可以注册为属性, lua中用 obj.field 读, obj.field = v 写. 属性名的查找用lua字符串的哈希,
+   和方法一样只查一次表. 成员本身是绑定类时, 读取返回引用该成员的userdata, 不复制, 并保持所属对象不被回收.
+*/
+template<class T>
+struct lua_class_traits
+{
+    static const bool is_bound = false;
+    using bases_t = std::tuple<>;
+};
+
+namespace Internal
+{
+    struct LuaClassInfo;
+
+    //基类子对象相对于对象起始地址的偏移, 包括间接基类
+    struct LuaClassBaseOffset
+    {
+        const LuaClassInfo * m_pInfo;
+        std::ptrdiff_t m_offset;
+    };
+
+    //每个绑定类一个静态对象, 其地址同时作为类型标识和元表在注册表中的key
+    struct LuaClassInfo
+    {
+        //直接基类, 注册时复制方法用
+        const LuaClassInfo * const * m_ppBases;
+        int m_nBases;
+        //取得所有基类的偏移表, 按深度优先顺序展开, 类型转换只需查表加偏移
+        const LuaClassBaseOffset * (*m_pfnOffsets)();
+        int m_nOffsets;
+    };
+
+    //userdata的头部, 值对象紧跟其后
+    struct LuaObjectHeader
+    {
+        const LuaClassInfo * m_pClass;
+        void * m_pObject;
+        //值对象的析构函数, 引用的对象为nullptr
+        void(*m_pfnDestroy)(void *);
+    };
+
+    template<class T>
+    void LuaClassDestroy(void * pObject)
+    {
+        static_cast<T *>(pObject)->~T();
+    }
+
+    //----编译期展开继承关系----
+
+    //从派生类到某个基类的继承路径
+    template<class ...T>
+    struct LuaClassPath
+    {
+    };
+
+    template<class ..._Tuples>
+    struct LuaTupleCat;
+
+    template<>
+    struct LuaTupleCat<>
+    {
+        using type = std::tuple<>;
+    };
+
+    template<class ...A>
+    struct LuaTupleCat<std::tuple<A...> >
+    {
+        using type = std::tuple<A...>;
+    };
+
+    template<class ...A, class ...B, class ..._Rest>
+    struct LuaTupleCat<std::tuple<A...>, std::tuple<B...>, _Rest...>
+        : public LuaTupleCat<std::tuple<A..., B...>, _Rest...>
+    {
+    };
+
+    //_Path是到类C为止的路径, 生成经过C的所有基类路径
+    template<class C, class _Path, class _Bases = typename lua_class_traits<C>::bases_t>
+    struct LuaClassPaths;
+
+    template<class C, class ...P, class ...Bases>
+    struct LuaClassPaths<C, LuaClassPath<P...>, std::tuple<Bases...> >
+    {
+        using type = typename LuaTupleCat<
+            typename LuaTupleCat<std::tuple<LuaClassPath<P..., Bases> >,
+                typename LuaClassPaths<Bases, LuaClassPath<P..., Bases> >::type>::type...>::type;
+    };
+
+    //路径的终点
+    template<class _Path>
+    struct LuaClassPathTarget;
+
+    template<class T>
+    struct LuaClassPathTarget<LuaClassPath<T> >
+    {
+        using type = T;
+    };
+
+    template<class T, class U, class ..._Rest>
+    struct LuaClassPathTarget<LuaClassPath<T, U, _Rest...> >
+        : public LuaClassPathTarget<LuaClassPath<U, _Rest...> >
+    {
+    };
+
+    //沿路径逐级static_cast, 多重继承中重复出现的基类也不会有二义性
+    template<class _Path>
+    struct LuaClassPathCast;
+
+    template<class T>
+    struct LuaClassPathCast<LuaClassPath<T> >
+    {
+        static void * Cast(T * pObject)
+        {
+            return pObject;
+        }
+    };
+
+    template<class T, class U, class ..._Rest>
+    struct LuaClassPathCast<LuaClassPath<T, U, _Rest...> >
+    {
+        static void * Cast(T * pObject)
+        {
+            return LuaClassPathCast<LuaClassPath<U, _Rest...> >::Cast(static_cast<U *>(pObject));
+        }
+    };
+
+    /* 非虚继承时偏移是固定的, 用一个假的对象地址算出来, 不访问对象.
+    虚继承的偏移要运行时读对象, 不支持.
+    */
+    template<class T, class ..._Rest>
+    std::ptrdiff_t LuaClassPathOffset(LuaClassPath<T, _Rest...> *)
+    {
+        T * pObject = reinterpret_cast<T *>((std::uintptr_t)0x10000);
+        return (char *)LuaClassPathCast<LuaClassPath<T, _Rest...> >::Cast(pObject) - (char *)pObject;
+    }
+
+    template<class _Paths>
+    struct LuaClassOffsetTable;
+
+    /* 偏移表要在运行时计算, 在首次使用时用std::call_once生成: 其他静态对象的初始化中注册类也不会读到空表,
+    多个线程(如lua_executor的工作线程)同时首次转换也不会读到未填完的表. 不用函数内的静态变量,
+    VS2013的函数内静态变量的初始化不是线程安全的. LuaClassInfo本身只含地址常量, 是常量初始化的.
+    */
+    template<class ..._Paths>
+    struct LuaClassOffsetTable<std::tuple<_Paths...> >
+    {
+        static const LuaClassBaseOffset * Get();
+
+    private:
+        static void Fill();
+
+        //末尾多一项, 避免空数组
+        static LuaClassBaseOffset s_offsets[sizeof...(_Paths) + 1];
+        static std::once_flag s_once;
+    };
+
+    template<class T, class _Bases = typename lua_class_traits<T>::bases_t>
+    struct LuaClassInfoOf;
+
+    template<class T, class ...Bases>
+    struct LuaClassInfoOf<T, std::tuple<Bases...> >
+    {
+        using paths_t = typename LuaClassPaths<T, LuaClassPath<T> >::type;
+
+        static const LuaClassInfo * const s_bases[sizeof...(Bases) + 1];
+        static const LuaClassInfo s_info;
+    };
+
+    template<class ..._Paths>
+    LuaClassBaseOffset LuaClassOffsetTable<std::tuple<_Paths...> >::s_offsets[sizeof...(_Paths) + 1];
+
+    template<class ..._Paths>
+    std::once_flag LuaClassOffsetTable<std::tuple<_Paths...> >::s_once;
+
+    template<class ..._Paths>
+    void LuaClassOffsetTable<std::tuple<_Paths...> >::Fill()
+    {
+        const LuaClassBaseOffset offsets[sizeof...(_Paths) + 1] = {
+            { &LuaClassInfoOf<typename LuaClassPathTarget<_Paths>::type>::s_info, LuaClassPathOffset((_Paths *)nullptr) }...,
+            { nullptr, 0 } };
+        for (size_t i = 0; i < sizeof...(_Paths) + 1; ++i)
+        {
+            s_offsets[i] = offsets[i];
+        }
+    }
+
+    template<class ..._Paths>
+    const LuaClassBaseOffset * LuaClassOffsetTable<std::tuple<_Paths...> >::Get()
+    {
+        std::call_once(s_once, &LuaClassOffsetTable::Fill);
+        return s_offsets;
+    }
+
+    template<class T, class ...Bases>
+    const LuaClassInfo * const LuaClassInfoOf<T, std::tuple<Bases...> >::s_bases[sizeof...(Bases) + 1] = {
+        &LuaClassInfoOf<Bases>::s_info..., nullptr };
+
+    template<class T, class ...Bases>
+    const LuaClassInfo LuaClassInfoOf<T, std::tuple<Bases...> >::s_info = {
+        LuaClassInfoOf<T, std::tuple<Bases...> >::s_bases, (int)sizeof...(Bases),
+        &LuaClassOffsetTable<typename LuaClassInfoOf<T, std::tuple<Bases...> >::paths_t>::Get,
+        (int)std::tuple_size<typename LuaClassInfoOf<T, std::tuple<Bases...> >::paths_t>::value };
+
+    //把pFrom类型的对象指针转换为pTo类型, 不是其基类时返回nullptr
+    inline void * LuaClassCast(const LuaClassInfo * pFrom, void * pObject, const LuaClassInfo * pTo)
+    {
+        if (pFrom == pTo)
+        {
+            return pObject;
+        }
+        if (pFrom->m_nOffsets == 0)
+        {
+            return nullptr;
+        }
+        const LuaClassBaseOffset * pOffsets = pFrom->m_pfnOffsets();
+        for (int i = 0; i < pFrom->m_nOffsets; ++i)
+        {
+            if (pOffsets[i].m_pInfo == pTo)
+            {
+                return (char *)pObject + pOffsets[i].m_offset;
+            }
+        }
+        return nullptr;
+    }
+
+    //检查index处是否为绑定类的userdata, 是的话转换为pTo类型的指针, 否则返回nullptr
+    void * LuaClassCheckCast(lua_State * pL, int index, const LuaClassInfo * pTo);
+
+    //类在pL中注册的名字, 没有注册时返回"userdata"
+    const char * LuaClassName(lua_State * pL, const LuaClassInfo * pInfo);
+
+    //压入引用对象的userdata, 类没有在pL中注册时压入lightuserdata
+    void LuaClassPushPointer(lua_State * pL, void * pObject, const LuaClassInfo * pInfo);
+
+    /** 创建值对象的userdata, 压入栈顶, 还没有关联元表
+    @return 对象的内存, 按对齐要求调整过
+    */
+    void * LuaClassNewObject(lua_State * pL, const LuaClassInfo * pInfo, size_t size, size_t align);
+
+    //对象构造成功后关联元表, 并记下析构函数. 类没有注册时返回false
+    bool LuaClassAttachObject(lua_State * pL, void(*pfnDestroy)(void *));
+
+    //注册时用, 创建元表和方法表, 复制基类的方法. 结束后栈上是: 元表, 方法表
+    void LuaClassBeginRegister(lua_State * pL, const LuaClassInfo * pInfo, const char * pClassName);
+
+    //注册时用, 添加属性的读写函数, pfnSet为nullptr时只读. 栈上应是: 元表, 方法表
+    void LuaClassAddProperty(lua_State * pL, const char * pName, lua_CFunction pfnGet, lua_CFunction pfnSet);
+
+    //注册时用, 方法表设为__index(有属性时由函数转发)和全局变量pClassName, 元表和方法表出栈
+    void LuaClassEndRegister(lua_State * pL, const char * pClassName);
+
+    //值对象压入lua, 构造在userdata中
+    template<class T, class _ArgType>
+    int LuaClassPushValue(lua_State * pL, _ArgType && value)
+    {
+        ::luaL_checkstack(pL, 3, "too many objects");
+        void * pObject = LuaClassNewObject(pL, &LuaClassInfoOf<T>::s_info, sizeof(T), std::alignment_of<T>::value);
+        ::new (pObject) T(std::forward<_ArgType>(value));
+        if (!LuaClassAttachObject(pL, &LuaClassDestroy<T>))
+        {
+            assert(!"lua class is not registered!");
+            static_cast<T *>(pObject)->~T();
+            ::lua_pop(pL, 1);
+            ::lua_pushnil(pL);
+        }
+        return 1;
+    }
+
+    //绑定类的值传递
+    template<class T>
+    struct LuaClassValueDispatcher
+    {
+        static int to_lua(lua_State * pL, const T & value)
+        {
+            return LuaClassPushValue<T>(pL, value);
+        }
+
+        static int to_lua(lua_State * pL, T && value)
+        {
+            return LuaClassPushValue<T>(pL, std::move(value));
+        }
+
+        static T from_lua(lua_State * pL, int index, T defaultValue = T{})
+        {
+            T * pObject = (T *)LuaClassCheckCast(pL, index, &LuaClassInfoOf<T>::s_info);
+            if (pObject)
+            {
+                return *pObject;
+            }
+            return defaultValue;
+        }
+    };
+
+    //指针传递, 没有绑定的类按lightuserdata
+    template<class T, bool isBound = lua_class_traits<std::remove_cv_t<T> >::is_bound>
+    struct LuaPointerDispatcher
+    {
+        static int to_lua(lua_State * pL, T * value)
+        {
+            ::lua_pushlightuserdata(pL, (void *)value);
+            return 1;
+        }
+
+        static T * from_lua(lua_State * pL, int index, T * defaultValue = nullptr)
+        {
+            if (::lua_type(pL, index) == LUA_TLIGHTUSERDATA)
+            {
+                return (T *)::lua_touserdata(pL, index);
+            }
+            return defaultValue;
+        }
+    };
+
+    template<class T>
+    struct LuaPointerDispatcher<T, true>
+    {
+        using class_type = std::remove_cv_t<T>;
+
+        static int to_lua(lua_State * pL, T * value)
+        {
+            if (value)
+            {
+                LuaClassPushPointer(pL, (void *)value, &LuaClassInfoOf<class_type>::s_info);
+            }
+            else
+            {
+                ::lua_pushnil(pL);
+            }
+            return 1;
+        }
+
+        static T * from_lua(lua_State * pL, int index, T * defaultValue = nullptr)
+        {
+            switch (::lua_type(pL, index))
+            {
+            case LUA_TUSERDATA:
+                {
+                    void * pObject = LuaClassCheckCast(pL, index, &LuaClassInfoOf<class_type>::s_info);
+                    return pObject ? (T *)pObject : defaultValue;
+                }
+            case LUA_TLIGHTUSERDATA:
+                return (T *)::lua_touserdata(pL, index);
+            case LUA_TNIL:
+                return nullptr;
+            default:
+                return defaultValue;
+            }
+        }
+    };
+
+    //lua中 Class.new(...) 的实现
+    template<class T, class _Signature>
+    struct LuaClassConstructor;
+
+    template<class T, class ...Args>
+    struct LuaClassConstructor<T, void(Args...)>
+    {
+        static int Invoke(lua_State * pL)
+        {
+            return InvokeCppCallableCatching(pL, &Construct, nullptr);
+        }
+
+        static int Construct(lua_State * pL, void *)
+        {
+            return InvokeImpl(pL, typename MakeSequence<sizeof...(Args)>::type());
+        }
+
+        template<size_t ... index>
+        static int InvokeImpl(lua_State * pL, IntegerSequence<index...>)
+        {
+            (void)pL;
+            ::luaL_checkstack(pL, 3, "too many objects");
+            void * pObject = LuaClassNewObject(pL, &LuaClassInfoOf<T>::s_info, sizeof(T), std::alignment_of<T>::value);
+            ::new (pObject) T(lua_io_dispatcher<std::decay_t<Args> >::from_lua(pL, index + 1)...);
+            if (!LuaClassAttachObject(pL, &LuaClassDestroy<T>))
+            {
+                static_cast<T *>(pObject)->~T();
+                return 0;
+            }
+            return 1;
+        }
+    };
+
+    template<class _MemberPtr>
+    struct LuaMemberPointerTraits;
+
+    template<class C, class M>
+    struct LuaMemberPointerTraits<M C::*>
+    {
+        using member_type = M;
+    };
+
+    //成员变量属性的读写函数, 栈上是: 1 对象, 2 属性名, 3 写入的值
+    template<class T, class _MemberPtr, _MemberPtr pMember,
+        class M = typename LuaMemberPointerTraits<_MemberPtr>::member_type,
+        bool isBound = lua_class_traits<std::remove_cv_t<M> >::is_bound>
+    struct LuaClassProperty
+    {
+        static int Get(lua_State * pL)
+        {
+            T * pObject = (T *)LuaClassCheckCast(pL, 1, &LuaClassInfoOf<T>::s_info);
+            if (!pObject)
+            {
+                return 0;
+            }
+            return lua_io_dispatcher<std::remove_cv_t<M> >::to_lua(pL, pObject->*pMember);
+        }
+
+        static int Set(lua_State * pL)
+        {
+            T * pObject = (T *)LuaClassCheckCast(pL, 1, &LuaClassInfoOf<T>::s_info);
+            if (pObject)
+            {
+                Assign(pL, pObject->*pMember, std::is_const<M>());
+            }
+            return 0;
+        }
+
+        //const成员只读
+        static lua_CFunction Setter()
+        {
+            return std::is_const<M>::value ? nullptr : &Set;
+        }
+
+    private:
+        template<class U>
+        static void Assign(lua_State * pL, U & member, std::false_type)
+        {
+            member = lua_io_dispatcher<U>::from_lua(pL, 3);
+        }
+
+        template<class U>
+        static void Assign(lua_State *, U &, std::true_type)
+        {
+        }
+    };
+
+    //成员是绑定类时, 读取返回引用成员的userdata, 用uservalue引用所属对象, 防止其先被回收
+    template<class T, class _MemberPtr, _MemberPtr pMember, class M>
+    struct LuaClassProperty<T, _MemberPtr, pMember, M, true>
+        : public LuaClassProperty<T, _MemberPtr, pMember, M, false>
+    {
+        static int Get(lua_State * pL)
+        {
+            T * pObject = (T *)LuaClassCheckCast(pL, 1, &LuaClassInfoOf<T>::s_info);
+            if (!pObject)
+            {
+                return 0;
+            }
+            LuaPointerDispatcher<M>::to_lua(pL, &(pObject->*pMember));
+            if (::lua_type(pL, -1) == LUA_TUSERDATA)
+            {
+                ::lua_pushvalue(pL, 1);
+                ::lua_setuservalue(pL, -2);
+            }
+            return 1;
+        }
+    };
+}
+
+//指针类型特化, 绑定类按userdata, 否则按lightuserdata
+template<class T>
+struct lua_io_dispatcher<T*, false>
+    : public Internal::LuaPointerDispatcher<T>
+{
+};
+
+template<class T>
+struct lua_type_of<T*>
+    : public std::integral_constant<int,
+        lua_class_traits<std::remove_cv_t<T> >::is_bound ? LUA_TUSERDATA : LUA_TLIGHTUSERDATA>
+{
+};
+
+/** 声明一个绑定类, 必须在全局命名空间中, 在使用该类与lua交互之前
+@param[in] cppClass: C++类
+*/
+#define DECLARE_LUA_CLASS_IMPLEMENT(cppClass) \
+    DECLARE_LUA_CLASS_TRAITS_IMPLEMENT(cppClass, )
+
+/** 声明一个有基类的绑定类, 基类也必须是绑定类. 不支持虚继承
+@param[in] cppClass: C++类
+@param[in] ...: 直接基类
+*/
+#define DECLARE_LUA_CLASS_BASES_IMPLEMENT(cppClass, ...) \
+    DECLARE_LUA_CLASS_TRAITS_IMPLEMENT(cppClass, __VA_ARGS__)
+
+#define DECLARE_LUA_CLASS_TRAITS_IMPLEMENT(cppClass, ...) \
+SHARELIB_BEGIN_NAMESPACE \
+template<> \
+struct lua_class_traits<cppClass> \
+{ \
+    static const bool is_bound = true; \
+    using bases_t = std::tuple<__VA_ARGS__>; \
+}; \
+template<> \
+struct lua_io_dispatcher<cppClass, false> \
+    : public Internal::LuaClassValueDispatcher<cppClass> \
+{ \
+}; \
+template<> \
+struct lua_type_of<cppClass> \
+    : public std::integral_constant<int, LUA_TUSERDATA> \
+{ \
+}; \
+SHARELIB_END_NAMESPACE
+
+/** 定义一个注册绑定类的函数
+@param[in] registerFuncName: 注册函数的名字, 不加引号
+@param[in] cppClass: C++类, 已经用DECLARE_LUA_CLASS_IMPLEMENT声明
+@param[in] pClassName: lua中的类名, const char *, 同时也是保存方法表的全局变量名
+*/
+#define BEGIN_LUA_CLASS_MAP_IMPLEMENT(registerFuncName, cppClass, pClassName) \
+void registerFuncName(lua_State * pLua) \
+{ \
+    using lua_class_type = cppClass; \
+    static_assert(shr::lua_class_traits<lua_class_type>::is_bound, "class is not declared"); \
+    const char * pLuaClassName = pClassName; \
+    assert(pLua); \
+    assert(pLuaClassName); \
+    shr::lua_stack_guard_checker stackChecker(pLua); \
+    shr::Internal::LuaClassBeginRegister(pLua, &shr::Internal::LuaClassInfoOf<lua_class_type>::s_info, pLuaClassName);
+
+/** 添加一个成员函数(或成员变量、第一个参数为对象指针的函数), lua中用 obj:luaName(...) 调用
+@param[in] luaName: lua中的方法名, const char *
+@param[in] cppCallable: C++调用, 由push_cpp_callable_to_lua实现
+*/
+#define ENTRY_LUA_CLASS_METHOD_IMPLEMENT(luaName, cppCallable) \
+    shr::push_cpp_callable_to_lua(pLua, cppCallable); \
+    ::lua_setfield(pLua, -2, luaName);
+
+/** 同ENTRY_LUA_CLASS_METHOD_IMPLEMENT, 调用前检查参数类型(lua_arg_policy::CHECKED)
+@param[in] luaName: lua中的方法名, const char *
+@param[in] cppCallable: C++调用
+*/
+#define ENTRY_LUA_CLASS_METHOD_CHECKED_IMPLEMENT(luaName, cppCallable) \
+    shr::push_cpp_callable_to_lua<shr::lua_arg_policy::CHECKED>(pLua, cppCallable); \
+    ::lua_setfield(pLua, -2, luaName);
+
+/** 添加构造函数, lua中用 Class.new(...) 创建值对象
+@param[in] ...: 构造函数的参数类型, 可以为空
+*/
+#define ENTRY_LUA_CLASS_CONSTRUCTOR_IMPLEMENT(...) \
+    ::lua_pushcfunction(pLua, (shr::Internal::LuaClassConstructor<lua_class_type, void(__VA_ARGS__)>::Invoke)); \
+    ::lua_setfield(pLua, -2, "new");
+
+/** 添加一个属性, lua中用 obj.luaName 读写, const成员只读
+@param[in] luaName: lua中的属性名, const char *
+@param[in] memberPtr: 成员变量指针, 如 &Class::m_member, 可以是基类的成员
+*/
+#define ENTRY_LUA_CLASS_PROPERTY_IMPLEMENT(luaName, memberPtr) \
+    shr::Internal::LuaClassAddProperty(pLua, luaName, \
+        &shr::Internal::LuaClassProperty<lua_class_type, decltype(memberPtr), memberPtr>::Get, \
+        shr::Internal::LuaClassProperty<lua_class_type, decltype(memberPtr), memberPtr>::Setter());
+
+/** 结束注册函数
+*/
+#define END_LUA_CLASS_MAP_IMPLEMENT() \
+    shr::Internal::LuaClassEndRegister(pLua, pLuaClassName); \
+}
+
+SHARELIB_END_NAMESPACE
@@ -0,0 +1,175 @@
+﻿#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "MacroDefBase.h"
+#include "lua_wrapper.h"
+
+SHARELIB_BEGIN_NAMESPACE
+
+namespace Internal
+{
+    //submit_call保存参数的类型, 字符串指针和数组复制为string, 不保存指针
+    template<class T, class _Decay = std::decay_t<T> >
+    struct LuaStoredArg
+    {
+        using type = _Decay;
+    };
+
+    template<class T>
+    struct LuaStoredArg<T, char *>
+    {
+        using type = std::string;
+    };
+
+    template<class T>
+    struct LuaStoredArg<T, const char *>
+    {
+        using type = std::string;
+    };
+
+    template<class T>
+    struct LuaStoredArg<T, wchar_t *>
+    {
+        using type = std::wstring;
+    };
+
+    template<class T>
+    struct LuaStoredArg<T, const wchar_t *>
+    {
+        using type = std::wstring;
+    };
+
+    /* lua_executor::submit_call的任务, 参数保存在tuple中, 在工作线程里展开调用.
+    std::function要求可复制, 因此promise用shared_ptr保存.
+    */
+    template<class _ResultType, class _ArgTuple>
+    struct LuaCallTask;
+
+    template<class ...R, class _ArgTuple>
+    struct LuaCallTask<std::tuple<R...>, _ArgTuple>
+    {
+        std::string m_funcName;
+        _ArgTuple m_args;
+        std::shared_ptr<std::promise<std::tuple<R...> > > m_spPromise;
+
+        void operator()(lua_state_wrapper & lua)
+        {
+            Invoke(lua, typename MakeSequence<std::tuple_size<_ArgTuple>::value>::type());
+        }
+
+        template<size_t ... index>
+        void Invoke(lua_state_wrapper & lua, IntegerSequence<index...>)
+        {
+            //call失败时错误信息留在栈上; 开启了set_rethrow_cpp_exception时抛出C++调用原来的异常
+            int nTop = lua.get_stack_count();
+            std::tuple<R...> results;
+            try
+            {
+                results = lua.call<R...>(m_funcName.c_str(), std::get<index>(m_args)...);
+            }
+            catch (...)
+            {
+                m_spPromise->set_exception(std::current_exception());
+                return;
+            }
+            if (lua.get_stack_count() > nTop)
+            {
+                m_spPromise->set_exception(std::make_exception_ptr(std::runtime_error(lua.get_error_msg())));
+            }
+            else
+            {
+                m_spPromise->set_value(std::move(results));
+            }
+        }
+    };
+}
+
+//----多线程执行lua脚本-------------------------------------------------------------
+
+/* lua_State是单线程的, 这个类创建N个工作线程, 每个线程独占一个lua_State, 这些lua_State都用同一个
+初始化函数注册C++调用、加载脚本. 提交的任务分配到各线程的任务队列中, 线程从自己的队列尾部取任务,
+自己的队列空了就从其它线程的队列头部窃取, 以平衡负载.
+各线程的lua_State互相独立, 全局变量不共享.
+*/
+class lua_executor
+{
+    SHARELIB_DISABLE_COPY_CLASS(lua_executor);
+public:
+    //初始化函数, 对每个工作线程的lua_State调用一次, 返回false表示失败
+    using init_func_t = std::function<bool(lua_state_wrapper &)>;
+    //任务, 参数是执行它的工作线程的lua_State
+    using task_t = std::function<void(lua_state_wrapper &)>;
+
+    lua_executor();
+
+    //等待已提交的任务执行完后退出
+    ~lua_executor();
+
+    /** 创建lua_State并启动工作线程, 初始化在调用线程中完成
+    @param[in] nThreads 线程个数, 0表示CPU核数
+    @param[in] fnInit 初始化函数
+    @return 任何一个lua_State创建或初始化失败都返回false, 不启动线程
+    */
+    bool start(size_t nThreads, init_func_t fnInit);
+
+    //停止接收任务, 等待已提交的任务执行完, 结束线程, 关闭lua_State
+    void stop();
+
+    size_t thread_count() const;
+
+    //提交任务, 未启动或已停止时返回false
+    bool post(task_t task);
+
+    /** 在某个工作线程中调用全局lua函数, 参数复制到任务中(字符串指针复制为std::string), 返回值由lua_state_wrapper::call转换
+    @return 返回值的future, lua出错时future中保存std::runtime_error; 未启动或已停止时future无效(valid()为false)
+    */
+    template<class ...R, class ...Args>
+    std::future<std::tuple<R...> > submit_call(const char * pFuncName, Args && ... args)
+    {
+        assert(pFuncName);
+        using _ArgTuple = std::tuple<typename Internal::LuaStoredArg<Args>::type...>;
+        Internal::LuaCallTask<std::tuple<R...>, _ArgTuple> task{
+            pFuncName,
+            _ArgTuple(std::forward<Args>(args)...),
+            std::make_shared<std::promise<std::tuple<R...> > >() };
+        auto result = task.m_spPromise->get_future();
+        if (!post(std::move(task)))
+        {
+            return std::future<std::tuple<R...> >();
+        }
+        return result;
+    }
+
+private:
+    struct worker
+    {
+        std::thread m_thread;
+        lua_state_wrapper m_lua;
+        std::mutex m_lock;
+        std::deque<task_t> m_tasks;
+    };
+
+    void worker_proc(size_t index);
+    bool pop_task(size_t index, task_t & task);
+
+    std::vector<std::unique_ptr<worker> > m_workers;
+    std::atomic<size_t> m_nextWorker;
+
+    //m_nPending: 所有队列中的任务总数
+    std::mutex m_waitLock;
+    std::condition_variable m_waitCond;
+    size_t m_nPending;
+    bool m_bRunning;
+};
+
+SHARELIB_END_NAMESPACE
@@ -5,9 +5,15 @@
 #include <codecvt>
 #include <cstdlib>
 #include <type_traits>
+#include <vector>
 #include "MacroDefBase.h"
 #include "lua_wrapper_base.h"
 
+#if (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || (__cplusplus >= 201703L)
+#include <string_view>
+#define LUA_WRAPPER_HAS_STRING_VIEW 1
+#endif
+
 SHARELIB_BEGIN_NAMESPACE
 
 //---------------------------------------------------
@@ -26,6 +32,103 @@ struct lua_table_key_t
     const char * m_pKey;
 };
 
+namespace Internal
+{
+    /* 小缓冲区的栈, 元素个数不超过N时用内部的数组, 不分配内存. 
+    lua_istream和lua_ostream用它保存嵌套table的层次, 只用于简单的结构体.
+    */
+    template<class T, size_t N>
+    class SmallStack
+    {
+    public:
+        SmallStack()
+            : m_size(0)
+        {
+        }
+
+        void push(const T & value)
+        {
+            if (m_size < N)
+            {
+                m_buffer[m_size] = value;
+            }
+            else
+            {
+                m_overflow.push_back(value);
+            }
+            ++m_size;
+        }
+
+        void pop()
+        {
+            assert(m_size > 0);
+            --m_size;
+            if (m_size >= N)
+            {
+                m_overflow.pop_back();
+            }
+        }
+
+        T & top()
+        {
+            assert(m_size > 0);
+            return (*this)[m_size - 1];
+        }
+
+        const T & top() const
+        {
+            assert(m_size > 0);
+            return (*this)[m_size - 1];
+        }
+
+        T & operator[](size_t index)
+        {
+            return (index < N) ? m_buffer[index] : m_overflow[index - N];
+        }
+
+        const T & operator[](size_t index) const
+        {
+            return (index < N) ? m_buffer[index] : m_overflow[index - N];
+        }
+
+        size_t size() const
+        {
+            return m_size;
+        }
+
+        bool empty() const
+        {
+            return m_size == 0;
+        }
+
+    private:
+        T m_buffer[N];
+        std::vector<T> m_overflow;
+        size_t m_size;
+    };
+}
+
+/* lua字符串的引用, 带长度, 可以包含'\0', 不复制字符串.
+用于C++调用的参数时, 指向lua内部的字符串, 只在这次调用期间有效, 需要保存的话复制出来.
+*/
+struct lua_string_ref
+{
+    lua_string_ref()
+        : m_pStr("")
+        , m_len(0)
+    {
+    }
+
+    lua_string_ref(const char * pStr, size_t len)
+        : m_pStr(pStr)
+        , m_len(len)
+    {
+    }
+
+    const char * m_pStr;
+    size_t m_len;
+};
+
 //----往lua栈上push数据-----------------------------------
 
 /* 重载的 << 运算符原型:
@@ -59,11 +162,19 @@ public:
 //----char字符串----------------------------
     lua_ostream & operator << (char * value);
     lua_ostream & operator << (const char * value);
+    lua_ostream & operator << (lua_string_ref value);
     template<class T1, class T2>
     lua_ostream & operator << (const std::basic_string<char, T1, T2> & value)
     {
-        return (*this) << (const char *)value.c_str();
+        return (*this) << lua_string_ref(value.data(), value.size());
+    }
+#ifdef LUA_WRAPPER_HAS_STRING_VIEW
+    template<class T1>
+    lua_ostream & operator << (std::basic_string_view<char, T1> value)
+    {
+        return (*this) << lua_string_ref(value.data(), value.size());
     }
+#endif
 
 //----wchar_t字符串----------------------------
     lua_ostream & operator << (wchar_t * value);
@@ -98,15 +209,32 @@ public:
     }
 
 //----table----------------------------
-    struct table_begin_t{};
+    //nArray, nHash: 预分配的数组部分和哈希部分的大小, 传给lua_createtable
+    struct table_begin_t
+    {
+        explicit table_begin_t(int nArray = 0, int nHash = 0)
+            : m_nArray(nArray)
+            , m_nHash(nHash)
+        {
+        }
+        int m_nArray;
+        int m_nHash;
+    };
     static const table_begin_t table_begin;
     struct table_end_t{};
     static const table_end_t table_end;
 
-    /*必须配对使用, 表示table输出的起止, 不支持嵌套.
-    一个配对的table操作之后, 栈顶便是这个新加入的table
+    //预先知道元素个数时使用, 避免插入过程中table反复扩容
+    static table_begin_t table_begin_sized(int nArray, int nHash = 0)
+    {
+        return table_begin_t(nArray, nHash);
+    }
+
+    /*必须配对使用, 表示table输出的起止, 可以嵌套: 在table中再次table_begin, 
+    对应的table_end之后, 这个子table作为一个元素插入外层table(之前 <<lua_table_key_t 的话就是该key的值).
+    最外层的一对table操作之后, 栈顶便是这个新加入的table
     */
-    lua_ostream & operator << (table_begin_t);
+    lua_ostream & operator << (table_begin_t tableBegin);
     lua_ostream & operator << (table_end_t);
 
     /* 先输出key到lua中, 再把值输出到lua栈上, 栈顶的的值便取该名字
@@ -116,6 +244,7 @@ public:
     /** 用于存入嵌套的table时。外层lua_ostream << table_begin；
     而后重新构造一个lua_ostream，存入完整的内层table；
     之后把嵌套的子table插入到外层table中。
+    嵌套的table_begin/table_end可以达到同样的效果, 不需要另外构造lua_ostream.
     @param[in] subTable 里面存入了一个完整的内存table
     */
     void insert_subtable(lua_ostream & subTable);
@@ -128,8 +257,16 @@ private:
     */
     void check_table_push();
 
+    //正在写入的一层table
+    struct frame_t
+    {
+        int m_tableIndex;
+        //下一个不指定key的元素的下标, 不用每次lua_rawlen
+        lua_Integer m_arrayIndex;
+    };
+
     lua_State * const m_pLua;
-    int m_tableIndex;
+    Internal::SmallStack<frame_t, 8> m_frames;
 };
 
 //----从lua中指定的栈位置读取数据--------------------------
@@ -160,6 +297,20 @@ public:
     //栈顶的值是否是一个嵌套的子table。首先要求自身是一个table
     bool is_subtable() const;
 
+//----嵌套table----------------------------
+    struct table_begin_t{};
+    static const table_begin_t table_begin;
+    struct table_end_t{};
+    static const table_end_t table_end;
+
+    /* 必须配对使用, 进入/退出当前值所在的子table, 可以多层嵌套:
+    >>table_begin之后, 读取的是子table中的元素, eof表示子table是否读完; 
+    >>table_end之后回到外层table, 继续读取子table之后的元素.
+    当前值不是table时, >>table_begin失败(bad为true), 之后的读取都失败, 直到>>table_end.
+    */
+    lua_istream & operator >> (table_begin_t);
+    lua_istream & operator >> (table_end_t);
+
 //----数值类型--------------------------
     lua_istream & operator >> (bool & value);
     lua_istream & operator >> (char & value);
@@ -178,20 +329,30 @@ public:
     lua_istream & operator >> (long double & value);
 
 //----char字符串----------------------------
+    //读取的是lua内部字符串的引用, 只在该字符串仍被lua引用时有效
+    lua_istream & operator >> (lua_string_ref & value);
     template<class T1, class T2>
     lua_istream & operator >> (std::basic_string<char, T1, T2> & value)
     {
-        if (!m_isEof)
+        lua_string_ref temp;
+        if ((*this) >> temp)
         {
-            m_isOK = (::lua_type(m_pLua, get_value_index()) == LUA_TSTRING);
-            if (m_isOK)
-            {
-                value = ::lua_tostring(m_pLua, get_value_index());
-            }
-            next();
+            value.assign(temp.m_pStr, temp.m_len);
         }
         return *this;
     }
+#ifdef LUA_WRAPPER_HAS_STRING_VIEW
+    template<class T1>
+    lua_istream & operator >> (std::basic_string_view<char, T1> & value)
+    {
+        lua_string_ref temp;
+        if ((*this) >> temp)
+        {
+            value = std::basic_string_view<char, T1>(temp.m_pStr, temp.m_len);
+        }
+        return *this;
+    }
+#endif
 
 //----wchar_t字符串----------------------------
     template<class T1, class T2>
@@ -223,7 +384,7 @@ public:
     template<class T>
     lua_istream & operator >> (T * & value)
     {
-        if (!m_isEof)
+        if (!eof())
         {
             m_isOK = (::lua_type(m_pLua, get_value_index()) == LUA_TLIGHTUSERDATA);
             if (m_isOK)
@@ -240,10 +401,11 @@ public:
      */
     lua_istream & operator >> (lua_table_key_t key);
 
-    /* 如果值是table，可以依次连续读取table元素到变量。但不支持table嵌套的情况下连续读取。
+    /* 如果值是table，可以依次连续读取table元素到变量。
     table嵌套时，前面的读完之后，栈顶就是子table(is_subtable为true)，这时构造一个新的lua_istream(pLua, -1); 
     用这个新的lua_istream就可以连续读取子table中的变量了。
-    读取完毕子table后，传给这个函数，进行栈清理
+    读取完毕子table后，传给这个函数，进行栈清理. 
+    也可以直接用>>table_begin和>>table_end, 不需要另外构造lua_istream.
     */
     void cleanup_subtable(lua_istream & subTable);
 
@@ -258,12 +420,24 @@ private:
     int get_value_index();
     void next();
 
+    //正在读取的一层, 最底层是构造时指定的栈位置
+    struct frame_t
+    {
+        int m_stackIndex;
+        int m_top;
+        bool m_isTable;
+        bool m_isEof;
+        bool m_isTableKey;
+    };
+
+    //开始读取stackIndex处的值, 是table的话开始遍历
+    void push_frame(int stackIndex);
+
     lua_State * const m_pLua;
     const int m_stackIndex;
     const int m_top;
-    bool m_isEof;
+    Internal::SmallStack<frame_t, 8> m_frames;
     bool m_isOK;
-    bool m_isTableKey;
 };
 
 //----lua调用C++函数时, 传参及返回值的转接类------------------------------------------------------
@@ -326,8 +500,87 @@ struct lua_io_dispatcher<T, true>
 
     static T from_lua(lua_State * pL, int index, T defaultValue = T{})
     {
-        lua_stack_guard_checker checker(pL);
-        return static_cast<T>(lua_io_dispatcher<_UType>::from_lua(pL, index, defaultValue));
+        return static_cast<T>(lua_io_dispatcher<_UType>::from_lua(pL, index, static_cast<_UType>(defaultValue)));
+    }
+};
+
+/* 数值类型特化, 直接读写栈上的值, 不构造lua_istream和lua_ostream.
+类型检查与lua_istream相同: 只接受number(bool只接受boolean), 不做字符串转换;
+整数类型遇到没有整数表示的number(比如2.5)时返回默认值.
+*/
+#define LUA_IO_DISPATCHER_INTEGER(type) \
+template<> \
+struct lua_io_dispatcher<type, false> \
+{ \
+    static int to_lua(lua_State * pL, type value) \
+    { \
+        ::lua_pushinteger(pL, (lua_Integer)value); \
+        return 1; \
+    } \
+    static type from_lua(lua_State * pL, int index, type defaultValue = 0) \
+    { \
+        int isNum = 0; \
+        lua_Integer value = 0; \
+        if (::lua_type(pL, index) == LUA_TNUMBER) \
+        { \
+            value = ::lua_tointegerx(pL, index, &isNum); \
+        } \
+        return isNum ? (type)value : defaultValue; \
+    } \
+};
+LUA_IO_DISPATCHER_INTEGER(char)
+LUA_IO_DISPATCHER_INTEGER(unsigned char)
+LUA_IO_DISPATCHER_INTEGER(wchar_t)
+LUA_IO_DISPATCHER_INTEGER(short)
+LUA_IO_DISPATCHER_INTEGER(unsigned short)
+LUA_IO_DISPATCHER_INTEGER(int)
+LUA_IO_DISPATCHER_INTEGER(unsigned int)
+LUA_IO_DISPATCHER_INTEGER(long)
+LUA_IO_DISPATCHER_INTEGER(unsigned long)
+LUA_IO_DISPATCHER_INTEGER(long long)
+LUA_IO_DISPATCHER_INTEGER(unsigned long long)
+#undef LUA_IO_DISPATCHER_INTEGER
+
+#define LUA_IO_DISPATCHER_FLOAT_POINT(type) \
+template<> \
+struct lua_io_dispatcher<type, false> \
+{ \
+    static int to_lua(lua_State * pL, type value) \
+    { \
+        ::lua_pushnumber(pL, (lua_Number)value); \
+        return 1; \
+    } \
+    static type from_lua(lua_State * pL, int index, type defaultValue = 0) \
+    { \
+        if (::lua_type(pL, index) == LUA_TNUMBER) \
+        { \
+            return (type)::lua_tonumberx(pL, index, nullptr); \
+        } \
+        return defaultValue; \
+    } \
+};
+LUA_IO_DISPATCHER_FLOAT_POINT(float)
+LUA_IO_DISPATCHER_FLOAT_POINT(double)
+LUA_IO_DISPATCHER_FLOAT_POINT(long double)
+#undef LUA_IO_DISPATCHER_FLOAT_POINT
+
+//bool类型特化
+template<>
+struct lua_io_dispatcher<bool, false>
+{
+    static int to_lua(lua_State * pL, bool value)
+    {
+        ::lua_pushboolean(pL, int(value));
+        return 1;
+    }
+
+    static bool from_lua(lua_State * pL, int index, bool defaultValue = false)
+    {
+        if (::lua_type(pL, index) == LUA_TBOOLEAN)
+        {
+            return !!::lua_toboolean(pL, index);
+        }
+        return defaultValue;
     }
 };
 
@@ -360,6 +613,78 @@ struct lua_io_dispatcher<char*, false>
 {
 };
 
+//lua_string_ref类型特化, 直接用lua_tolstring和lua_pushlstring, 不经过lua_istream和lua_ostream
+template<>
+struct lua_io_dispatcher<lua_string_ref, false>
+{
+    static int to_lua(lua_State * pL, lua_string_ref value)
+    {
+        ::lua_pushlstring(pL, value.m_pStr, value.m_len);
+        return 1;
+    }
+
+    static lua_string_ref from_lua(lua_State * pL, int index, lua_string_ref defaultValue = lua_string_ref())
+    {
+        if (::lua_type(pL, index) == LUA_TSTRING)
+        {
+            size_t len = 0;
+            const char * pStr = ::lua_tolstring(pL, index, &len);
+            return lua_string_ref(pStr, len);
+        }
+        return defaultValue;
+    }
+};
+
+//std::string类型特化
+template<class T1, class T2>
+struct lua_io_dispatcher<std::basic_string<char, T1, T2>, false>
+{
+    using string_type = std::basic_string<char, T1, T2>;
+
+    static int to_lua(lua_State * pL, const string_type & value)
+    {
+        ::lua_pushlstring(pL, value.data(), value.size());
+        return 1;
+    }
+
+    static string_type from_lua(lua_State * pL, int index, string_type defaultValue = string_type())
+    {
+        if (::lua_type(pL, index) == LUA_TSTRING)
+        {
+            size_t len = 0;
+            const char * pStr = ::lua_tolstring(pL, index, &len);
+            return string_type(pStr, len);
+        }
+        return defaultValue;
+    }
+};
+
+#ifdef LUA_WRAPPER_HAS_STRING_VIEW
+//std::string_view类型特化, 用于参数时与lua_string_ref一样只在这次调用期间有效
+template<class T1>
+struct lua_io_dispatcher<std::basic_string_view<char, T1>, false>
+{
+    using string_type = std::basic_string_view<char, T1>;
+
+    static int to_lua(lua_State * pL, string_type value)
+    {
+        ::lua_pushlstring(pL, value.data(), value.size());
+        return 1;
+    }
+
+    static string_type from_lua(lua_State * pL, int index, string_type defaultValue = string_type())
+    {
+        if (::lua_type(pL, index) == LUA_TSTRING)
+        {
+            size_t len = 0;
+            const char * pStr = ::lua_tolstring(pL, index, &len);
+            return string_type(pStr, len);
+        }
+        return defaultValue;
+    }
+};
+#endif
+
 namespace Internal
 {
     /* 为了解决wchar_t* 类型的模板特化.
@@ -423,4 +748,70 @@ struct lua_io_dispatcher<wchar_t*, false>
 {
 };
 
+//----C++类型对应的lua类型----------------------------------------------
+
+/* 注册重载时用来按参数类型选择调用, value为LUA_TXXX, LUA_TNONE表示不检查类型.
+自定义类型如有必要可以特化, 比如:
+template<> struct lua_type_of<RECT> : public std::integral_constant<int, LUA_TTABLE> {};
+*/
+template<class T>
+struct lua_type_of
+    : public std::integral_constant<int,
+        std::is_same<T, bool>::value ? LUA_TBOOLEAN :
+        (std::is_arithmetic<T>::value || std::is_enum<T>::value) ? LUA_TNUMBER :
+        std::is_pointer<T>::value ? LUA_TLIGHTUSERDATA :
+        LUA_TNONE>
+{
+};
+
+template<class T1, class T2>
+struct lua_type_of<std::basic_string<char, T1, T2> >
+    : public std::integral_constant<int, LUA_TSTRING>
+{
+};
+
+template<class T1, class T2>
+struct lua_type_of<std::basic_string<wchar_t, T1, T2> >
+    : public std::integral_constant<int, LUA_TSTRING>
+{
+};
+
+template<>
+struct lua_type_of<lua_string_ref>
+    : public std::integral_constant<int, LUA_TSTRING>
+{
+};
+
+#ifdef LUA_WRAPPER_HAS_STRING_VIEW
+template<class T1>
+struct lua_type_of<std::basic_string_view<char, T1> >
+    : public std::integral_constant<int, LUA_TSTRING>
+{
+};
+#endif
+
+template<>
+struct lua_type_of<const char*>
+    : public std::integral_constant<int, LUA_TSTRING>
+{
+};
+
+template<>
+struct lua_type_of<char*>
+    : public std::integral_constant<int, LUA_TSTRING>
+{
+};
+
+template<>
+struct lua_type_of<const wchar_t*>
+    : public std::integral_constant<int, LUA_TSTRING>
+{
+};
+
+template<>
+struct lua_type_of<wchar_t*>
+    : public std::integral_constant<int, LUA_TSTRING>
+{
+};
+
 SHARELIB_END_NAMESPACE
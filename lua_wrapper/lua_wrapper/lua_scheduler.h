@@ -0,0 +1,142 @@
+﻿#pragma once
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <vector>
+#include "MacroDefBase.h"
+#include "lua_wrapper.h"
+
+SHARELIB_BEGIN_NAMESPACE
+
+//----协程调度器-------------------------------------------------------------
+
+/* 在一个lua_State中用协程(lua_newthread)同时运行多个lua任务, 任务共享全局变量、字符串表和注册的C++调用,
+每个任务只多占一个协程的内存(KB量级), 而不是一个完整的lua_State.
+1. spawn创建任务, 优先级高的先运行, 同优先级按先后轮流运行; spawn_after延迟启动, 用作定时器;
+2. 任务中调用sleep(秒)(见register_sleep)挂起一段时间, 调用coroutine.yield()让出执行权到下一轮,
+   调用返回std::future的异步C++调用(lua_async.h)时挂起到结果就绪;
+3. run_once执行一轮, run一直执行到所有任务结束; 都在调用线程中执行, 不是线程安全的;
+4. set_time_slice限制任务每次连续执行的指令数, 用完后任务被挂起到下一轮, 一个死循环的任务不会让其他任务停止;
+5. 正常结束的协程放回空闲列表复用, 不交给垃圾回收; 出错的协程不能再用, 释放引用由垃圾回收;
+6. 调度器引用的协程保存在注册表中, 调度器必须在lua_State关闭之前销毁.
+*/
+class lua_scheduler
+{
+    SHARELIB_DISABLE_COPY_CLASS(lua_scheduler);
+public:
+    using clock_t = std::chrono::steady_clock;
+    //任务id, 0表示无效
+    using task_id_t = unsigned int;
+    //任务出错时的回调, 参数是任务id和错误信息
+    using error_func_t = std::function<void(task_id_t, const char *)>;
+
+    explicit lua_scheduler(lua_State * pLua);
+
+    //未结束的任务直接丢弃
+    ~lua_scheduler();
+
+    /** 注册全局函数 sleep(seconds), 只能在任务中调用
+    @param[in] pName 函数名
+    */
+    void register_sleep(const char * pName = "sleep");
+
+    /** 创建任务, 下一轮开始运行
+    @param[in] func 要运行的lua函数, 如lua_state_wrapper::get_function_ref或load_chunk_xxx的结果
+    @param[in] priority 优先级, 越大越先运行
+    @param[in] args 传给函数的参数, 由lua_io_dispatcher转换
+    @return 任务id, 失败时返回0
+    */
+    template<class ...Args>
+    task_id_t spawn(const lua_function_ref & func, int priority, Args && ... args)
+    {
+        return spawn_after(0.0, func, priority, std::forward<Args>(args)...);
+    }
+
+    //同spawn, 等待seconds秒后才开始运行
+    template<class ...Args>
+    task_id_t spawn_after(double seconds, const lua_function_ref & func, int priority, Args && ... args)
+    {
+        assert(func.valid());
+        int threadRef = LUA_NOREF;
+        lua_State * pThread = acquire_thread(threadRef);
+        if (!::lua_checkstack(pThread, (int)sizeof...(Args) + 1)
+            || (LUA_TFUNCTION != ::lua_rawgeti(pThread, LUA_REGISTRYINDEX, func.get())))
+        {
+            ::lua_settop(pThread, 0);
+            release_thread(pThread, threadRef, true);
+            return 0;
+        }
+        int nArgs = Internal::PushLuaArgs(pThread, std::forward<Args>(args)...);
+        return add_task(pThread, threadRef, nArgs, priority, seconds);
+    }
+
+    /** 执行一轮: 唤醒到期的和异步结果就绪的任务, 可运行的任务按优先级各运行一次
+    @return 剩余的任务数
+    */
+    size_t run_once();
+
+    //执行到所有任务结束, 没有可运行的任务时休眠到最早的定时器
+    void run();
+
+    size_t task_count() const;
+
+    size_t free_thread_count() const;
+
+    //空闲列表的最大长度, 超出的协程交给垃圾回收. 默认256
+    void set_max_free_threads(size_t nCount);
+
+    //任务出错时的回调, 默认忽略错误
+    void set_error_handler(error_func_t fnError);
+
+    /** 任务每次运行最多连续执行的虚拟机指令数, 用LUA_MASKCOUNT的钩子实现, 会覆盖任务协程上的其他钩子
+    (如lua_state_wrapper::set_run_budget). 任务中创建的协程不受限制.
+    @param[in] nInstructions 指令数, 0表示不限制(默认)
+    */
+    void set_time_slice(int nInstructions);
+
+private:
+    struct task
+    {
+        task_id_t m_id;
+        lua_State * m_pThread;
+        int m_threadRef;
+        int m_priority;
+        //下次lua_resume传入的参数个数, 只有首次运行时不为0
+        int m_nArgs;
+        //上次是用完时间片被挂起的, 栈上是执行中的lua函数, 不能清除
+        bool m_bPreempted;
+        clock_t::time_point m_wakeTime;
+    };
+
+    static void time_slice_hook(lua_State * pLua, lua_Debug * pDebug);
+
+    lua_State * acquire_thread(int & threadRef);
+    void release_thread(lua_State * pThread, int threadRef, bool bReusable);
+    task_id_t add_task(lua_State * pThread, int threadRef, int nArgs, int priority, double seconds);
+    void push_ready(task && t);
+    void push_sleeping(task && t);
+    void resume_task(task & t);
+
+    lua_State * m_pLua;
+    task_id_t m_nextId;
+    //可运行的任务, 按优先级从高到低
+    std::map<int, std::deque<task>, std::greater<int> > m_ready;
+    //本轮要运行的任务, 复用内存
+    std::vector<task> m_running;
+    //sleep或延迟启动的任务, 按唤醒时间的小顶堆
+    std::vector<task> m_sleeping;
+    //等待异步C++调用结果的任务
+    std::vector<task> m_waiting;
+    //空闲的协程和它在注册表中的引用
+    std::vector<std::pair<lua_State *, int> > m_freeThreads;
+    size_t m_nMaxFreeThreads;
+    error_func_t m_fnError;
+    int m_nTimeSlice;
+    //正在运行的任务协程, 以及它是否用完了时间片
+    lua_State * m_pCurrentThread;
+    bool m_bPreempted;
+};
+
+SHARELIB_END_NAMESPACE
@@ -0,0 +1,80 @@
+﻿#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "MacroDefBase.h"
+#include "lua_wrapper.h"
+
+SHARELIB_BEGIN_NAMESPACE
+
+//----预先初始化的lua_State池-------------------------------------------------------------
+
+/* 创建lua_State并注册C++调用的代价是毫秒量级, 频繁创建时用这个池复用:
+1. 每个lua_State只在第一次创建时执行一次初始化函数(注册C++调用、加载脚本等), 之后保存全局变量的快照;
+2. acquire取出一个lua_State, 租借对象析构时自动归还, 归还时用reset_globals恢复全局变量和加载的脚本, 而不是关闭重建;
+3. 线程安全, 但一个lua_State同一时间只能被一个线程使用;
+4. 池对象必须比它借出的所有lua_State后销毁.
+*/
+class lua_state_pool
+{
+    SHARELIB_DISABLE_COPY_CLASS(lua_state_pool);
+public:
+    //初始化函数, 对每个新创建的lua_State调用一次, 返回false表示初始化失败, 该lua_State被丢弃
+    using init_func_t = std::function<bool(lua_state_wrapper &)>;
+
+    //借出的lua_State, 析构时归还给池
+    class lease
+    {
+        SHARELIB_DISABLE_COPY_CLASS(lease);
+    public:
+        lease();
+        lease(lease && other);
+        lease & operator=(lease && other);
+        ~lease();
+
+        //是否成功借到
+        bool valid() const;
+        lua_state_wrapper * get() const;
+        lua_state_wrapper * operator->() const;
+        lua_state_wrapper & operator*() const;
+
+        //提前归还
+        void reset();
+
+    private:
+        friend class lua_state_pool;
+        lease(lua_state_pool * pPool, std::unique_ptr<lua_state_wrapper> && spLua);
+
+        lua_state_pool * m_pPool;
+        std::unique_ptr<lua_state_wrapper> m_spLua;
+    };
+
+    /**
+    @param[in] fnInit 初始化函数
+    @param[in] nMaxIdle 池中最多保留的空闲lua_State个数, 超出时归还的lua_State直接关闭
+    */
+    explicit lua_state_pool(init_func_t fnInit, size_t nMaxIdle = 16);
+    ~lua_state_pool();
+
+    //借出一个lua_State, 没有空闲的就新建一个. 创建或初始化失败时返回的lease::valid()为false
+    lease acquire();
+
+    //预先创建count个空闲的lua_State(不超过nMaxIdle), 返回实际空闲的个数
+    size_t prepare(size_t count);
+
+    //当前空闲的个数
+    size_t idle_count() const;
+
+private:
+    std::unique_ptr<lua_state_wrapper> create_state();
+    void release(std::unique_ptr<lua_state_wrapper> && spLua);
+
+    const init_func_t m_fnInit;
+    const size_t m_nMaxIdle;
+    mutable std::mutex m_lock;
+    std::vector<std::unique_ptr<lua_state_wrapper> > m_idleStates;
+};
+
+SHARELIB_END_NAMESPACE
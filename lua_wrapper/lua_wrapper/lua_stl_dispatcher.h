@@ -0,0 +1,314 @@
+﻿#pragma once
+
+#include <array>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "MacroDefBase.h"
+#include "lua_iostream.h"
+#include "MetaUtility.h"
+
+#if (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || (__cplusplus >= 201703L)
+#include <optional>
+#define LUA_WRAPPER_HAS_OPTIONAL 1
+#endif
+
+SHARELIB_BEGIN_NAMESPACE
+
+/* STL容器的lua_io_dispatcher特化, 元素的读写再转给元素类型的lua_io_dispatcher, 因此可以任意组合嵌套,
+比如 std::vector<std::map<std::string, std::vector<int>>>.
+1. vector, array, tuple, pair 对应lua的数组table, 下标从1开始;
+2. map, unordered_map 对应lua的table, 键值都由lua_io_dispatcher转换;
+3. optional 为空时对应nil, 读取时类型不符的也返回默认值;
+4. 读取时类型不是table的返回默认值, 元素读取失败的取元素的默认值, map中类型不符的键跳过.
+*/
+
+namespace Internal
+{
+    //index处的值是否可以按T读取, lua_type_of<T>为LUA_TNONE时不检查
+    template<class T>
+    bool LuaIsTypeOf(lua_State * pL, int index)
+    {
+        const int type = lua_type_of<T>::value;
+        return (type == LUA_TNONE) || (type == ::lua_type(pL, index))
+            || ((type == LUA_TLIGHTUSERDATA) && (::lua_type(pL, index) == LUA_TUSERDATA));
+    }
+
+    //数组table元素的读写, 用lua_rawgeti/lua_rawseti
+    template<class _Container, class T = typename _Container::value_type>
+    struct LuaSequenceDispatcher
+    {
+        static int to_lua(lua_State * pL, const _Container & value)
+        {
+            ::luaL_checkstack(pL, 2, "too many nested tables");
+            ::lua_createtable(pL, (int)value.size(), 0);
+            lua_Integer i = 0;
+            for (const auto & item : value)
+            {
+                if (lua_io_dispatcher<T>::to_lua(pL, item) > 0)
+                {
+                    ::lua_rawseti(pL, -2, ++i);
+                }
+            }
+            return 1;
+        }
+
+        static _Container from_lua(lua_State * pL, int index, _Container defaultValue = _Container())
+        {
+            if ((::lua_type(pL, index) != LUA_TTABLE) || !::lua_checkstack(pL, 1))
+            {
+                return defaultValue;
+            }
+            index = ::lua_absindex(pL, index);
+            const size_t count = (size_t)::lua_rawlen(pL, index);
+            _Container result;
+            result.reserve(count);
+            for (size_t i = 1; i <= count; ++i)
+            {
+                ::lua_rawgeti(pL, index, (lua_Integer)i);
+                result.push_back(lua_io_dispatcher<T>::from_lua(pL, -1));
+                ::lua_pop(pL, 1);
+            }
+            return result;
+        }
+    };
+
+    //键值对table的读写, 用lua_next/lua_rawset
+    template<class _Container,
+        class K = typename _Container::key_type,
+        class V = typename _Container::mapped_type>
+    struct LuaMapDispatcher
+    {
+        static int to_lua(lua_State * pL, const _Container & value)
+        {
+            ::luaL_checkstack(pL, 3, "too many nested tables");
+            ::lua_createtable(pL, 0, (int)value.size());
+            for (const auto & item : value)
+            {
+                if (lua_io_dispatcher<K>::to_lua(pL, item.first) == 0)
+                {
+                    continue;
+                }
+                if (lua_io_dispatcher<V>::to_lua(pL, item.second) == 0)
+                {
+                    ::lua_pop(pL, 1);
+                    continue;
+                }
+                ::lua_rawset(pL, -3);
+            }
+            return 1;
+        }
+
+        static _Container from_lua(lua_State * pL, int index, _Container defaultValue = _Container())
+        {
+            if ((::lua_type(pL, index) != LUA_TTABLE) || !::lua_checkstack(pL, 2))
+            {
+                return defaultValue;
+            }
+            index = ::lua_absindex(pL, index);
+            _Container result;
+            ::lua_pushnil(pL);
+            while (::lua_next(pL, index) != 0)
+            {
+                //类型不符的键跳过, 否则都变成默认值的键
+                if (!LuaIsTypeOf<K>(pL, -2))
+                {
+                    ::lua_pop(pL, 1);
+                    continue;
+                }
+                //键的lua_io_dispatcher不会修改栈上的键(字符串先检查类型, 不会被lua_tolstring转换), 不影响lua_next
+                K key = lua_io_dispatcher<K>::from_lua(pL, -2);
+                result.emplace(std::move(key), lua_io_dispatcher<V>::from_lua(pL, -1));
+                ::lua_pop(pL, 1);
+            }
+            return result;
+        }
+    };
+
+    template<class _Tuple, class _IndexType>
+    struct LuaTupleDispatcher;
+
+    template<class _Tuple, size_t ... index>
+    struct LuaTupleDispatcher<_Tuple, IntegerSequence<index...> >
+    {
+        template<size_t i>
+        using element_t = std::decay_t<typename std::tuple_element<i, _Tuple>::type>;
+
+        static int to_lua(lua_State * pL, const _Tuple & value)
+        {
+            ::luaL_checkstack(pL, 2, "too many nested tables");
+            ::lua_createtable(pL, (int)sizeof...(index), 0);
+            int dummy[] = { 0, SetElement<index>(pL, std::get<index>(value))... };
+            (void)dummy;
+            return 1;
+        }
+
+        static _Tuple from_lua(lua_State * pL, int index_, _Tuple defaultValue = _Tuple())
+        {
+            if ((::lua_type(pL, index_) != LUA_TTABLE) || !::lua_checkstack(pL, 1))
+            {
+                return defaultValue;
+            }
+            index_ = ::lua_absindex(pL, index_);
+            return _Tuple(GetElement<index>(pL, index_)...);
+        }
+
+    private:
+        template<size_t i>
+        static int SetElement(lua_State * pL, const element_t<i> & value)
+        {
+            if (lua_io_dispatcher<element_t<i> >::to_lua(pL, value) > 0)
+            {
+                ::lua_rawseti(pL, -2, (lua_Integer)(i + 1));
+            }
+            return 0;
+        }
+
+        template<size_t i>
+        static element_t<i> GetElement(lua_State * pL, int tableIndex)
+        {
+            ::lua_rawgeti(pL, tableIndex, (lua_Integer)(i + 1));
+            element_t<i> result = lua_io_dispatcher<element_t<i> >::from_lua(pL, -1);
+            ::lua_pop(pL, 1);
+            return result;
+        }
+    };
+}
+
+//std::vector类型特化
+template<class T, class _Alloc>
+struct lua_io_dispatcher<std::vector<T, _Alloc>, false>
+    : public Internal::LuaSequenceDispatcher<std::vector<T, _Alloc> >
+{
+};
+
+//std::array类型特化, lua中的元素个数不足时, 剩下的取默认值
+template<class T, size_t N>
+struct lua_io_dispatcher<std::array<T, N>, false>
+{
+    using container_type = std::array<T, N>;
+
+    static int to_lua(lua_State * pL, const container_type & value)
+    {
+        return Internal::LuaSequenceDispatcher<container_type>::to_lua(pL, value);
+    }
+
+    static container_type from_lua(lua_State * pL, int index, container_type defaultValue = container_type())
+    {
+        if ((::lua_type(pL, index) != LUA_TTABLE) || !::lua_checkstack(pL, 1))
+        {
+            return defaultValue;
+        }
+        index = ::lua_absindex(pL, index);
+        size_t count = (size_t)::lua_rawlen(pL, index);
+        if (count > N)
+        {
+            count = N;
+        }
+        container_type result{};
+        for (size_t i = 0; i < count; ++i)
+        {
+            ::lua_rawgeti(pL, index, (lua_Integer)(i + 1));
+            result[i] = lua_io_dispatcher<T>::from_lua(pL, -1);
+            ::lua_pop(pL, 1);
+        }
+        return result;
+    }
+};
+
+//std::map类型特化
+template<class K, class V, class _Pr, class _Alloc>
+struct lua_io_dispatcher<std::map<K, V, _Pr, _Alloc>, false>
+    : public Internal::LuaMapDispatcher<std::map<K, V, _Pr, _Alloc> >
+{
+};
+
+//std::unordered_map类型特化
+template<class K, class V, class _Hasher, class _Keyeq, class _Alloc>
+struct lua_io_dispatcher<std::unordered_map<K, V, _Hasher, _Keyeq, _Alloc>, false>
+    : public Internal::LuaMapDispatcher<std::unordered_map<K, V, _Hasher, _Keyeq, _Alloc> >
+{
+};
+
+//std::tuple类型特化
+template<class ...T>
+struct lua_io_dispatcher<std::tuple<T...>, false>
+    : public Internal::LuaTupleDispatcher<std::tuple<T...>, typename MakeSequence<sizeof...(T)>::type>
+{
+};
+
+//std::pair类型特化, 与两个元素的tuple相同
+template<class T1, class T2>
+struct lua_io_dispatcher<std::pair<T1, T2>, false>
+    : public Internal::LuaTupleDispatcher<std::pair<T1, T2>, typename MakeSequence<2>::type>
+{
+};
+
+#ifdef LUA_WRAPPER_HAS_OPTIONAL
+//std::optional类型特化
+template<class T>
+struct lua_io_dispatcher<std::optional<T>, false>
+{
+    static int to_lua(lua_State * pL, const std::optional<T> & value)
+    {
+        if (value)
+        {
+            return lua_io_dispatcher<T>::to_lua(pL, *value);
+        }
+        ::lua_pushnil(pL);
+        return 1;
+    }
+
+    static std::optional<T> from_lua(lua_State * pL, int index, std::optional<T> defaultValue = std::nullopt)
+    {
+        //nil和类型不符的值都返回defaultValue, 而不是T的默认值
+        if (lua_isnoneornil(pL, index) || !Internal::LuaIsTypeOf<T>(pL, index))
+        {
+            return defaultValue;
+        }
+        return lua_io_dispatcher<T>::from_lua(pL, index);
+    }
+};
+#endif
+
+//----容器对应的lua类型----------------------------------------------
+
+template<class T, class _Alloc>
+struct lua_type_of<std::vector<T, _Alloc> >
+    : public std::integral_constant<int, LUA_TTABLE>
+{
+};
+
+template<class T, size_t N>
+struct lua_type_of<std::array<T, N> >
+    : public std::integral_constant<int, LUA_TTABLE>
+{
+};
+
+template<class K, class V, class _Pr, class _Alloc>
+struct lua_type_of<std::map<K, V, _Pr, _Alloc> >
+    : public std::integral_constant<int, LUA_TTABLE>
+{
+};
+
+template<class K, class V, class _Hasher, class _Keyeq, class _Alloc>
+struct lua_type_of<std::unordered_map<K, V, _Hasher, _Keyeq, _Alloc> >
+    : public std::integral_constant<int, LUA_TTABLE>
+{
+};
+
+template<class ...T>
+struct lua_type_of<std::tuple<T...> >
+    : public std::integral_constant<int, LUA_TTABLE>
+{
+};
+
+template<class T1, class T2>
+struct lua_type_of<std::pair<T1, T2> >
+    : public std::integral_constant<int, LUA_TTABLE>
+{
+};
+
+SHARELIB_END_NAMESPACE
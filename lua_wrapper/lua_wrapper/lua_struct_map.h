@@ -0,0 +1,199 @@
+﻿#pragma once
+
+#include <type_traits>
+#include "MacroDefBase.h"
+#include "lua_iostream.h"
+
+SHARELIB_BEGIN_NAMESPACE
+
+/* 结构体与lua table的映射, 字段列表只声明一次, 同时生成读和写两个方向:
+1. 每个字段对应table中同名(或指定名字)的键, 值由字段类型的lua_io_dispatcher转换, 因此字段可以是
+   其它映射过的结构体、STL容器等;
+2. 字段名在每个lua_State中只创建一次lua字符串, 保存在注册表中, 之后按下标取出直接lua_rawget/lua_rawset;
+3. 写入lua时, table按字段个数预分配;
+4. 从lua读取时, table中没有的字段(nil)保持默认构造的值.
+用法(在全局命名空间中, 结构体定义之后):
+BEGIN_LUA_STRUCT_MAP_IMPLEMENT(WrapCompoment)
+    ENTRY_LUA_STRUCT_FIELD_IMPLEMENT(m_a)
+    ENTRY_LUA_STRUCT_FIELD_NAME_IMPLEMENT("c", m_c)
+END_LUA_STRUCT_MAP_IMPLEMENT()
+*/
+template<class T>
+struct lua_struct_map;
+
+namespace Internal
+{
+    struct LuaStructFieldCounter
+    {
+        int m_count;
+
+        template<class _FieldPtr>
+        void operator()(const char *, _FieldPtr)
+        {
+            ++m_count;
+        }
+    };
+
+    //字段名数组, 下标从1开始
+    struct LuaStructKeyCollector
+    {
+        lua_State * m_pLua;
+        int m_index;
+
+        template<class _FieldPtr>
+        void operator()(const char * pName, _FieldPtr)
+        {
+            ::lua_pushstring(m_pLua, pName);
+            ::lua_rawseti(m_pLua, -2, ++m_index);
+        }
+    };
+
+    template<class T>
+    struct LuaStructWriter
+    {
+        lua_State * m_pLua;
+        const T & m_obj;
+        int m_keysIndex;
+        int m_tableIndex;
+        int m_index;
+
+        template<class _FieldType>
+        void operator()(const char *, _FieldType T::* pField)
+        {
+            ::lua_rawgeti(m_pLua, m_keysIndex, ++m_index);
+            if (lua_io_dispatcher<std::decay_t<_FieldType> >::to_lua(m_pLua, m_obj.*pField) > 0)
+            {
+                ::lua_rawset(m_pLua, m_tableIndex);
+            }
+            else
+            {
+                ::lua_pop(m_pLua, 1);
+            }
+        }
+    };
+
+    template<class T>
+    struct LuaStructReader
+    {
+        lua_State * m_pLua;
+        T & m_obj;
+        int m_keysIndex;
+        int m_tableIndex;
+        int m_index;
+
+        template<class _FieldType>
+        void operator()(const char *, _FieldType T::* pField)
+        {
+            ::lua_rawgeti(m_pLua, m_keysIndex, ++m_index);
+            if (::lua_rawget(m_pLua, m_tableIndex) != LUA_TNIL)
+            {
+                m_obj.*pField = lua_io_dispatcher<std::decay_t<_FieldType> >::from_lua(m_pLua, -1);
+            }
+            ::lua_pop(m_pLua, 1);
+        }
+    };
+
+    //映射过的结构体的lua_io_dispatcher实现
+    template<class T>
+    struct LuaStructDispatcher
+    {
+        static const char s_keysKey;
+
+        static int FieldCount()
+        {
+            LuaStructFieldCounter counter = { 0 };
+            lua_struct_map<T>::visit(counter);
+            return counter.m_count;
+        }
+
+        //字段名数组压入栈顶, 每个lua_State第一次使用时创建, 以静态变量的地址为key保存在注册表中
+        static void PushKeys(lua_State * pL)
+        {
+            if (LUA_TTABLE != ::lua_rawgetp(pL, LUA_REGISTRYINDEX, &s_keysKey))
+            {
+                ::lua_pop(pL, 1);
+                ::lua_createtable(pL, FieldCount(), 0);
+                LuaStructKeyCollector collector = { pL, 0 };
+                lua_struct_map<T>::visit(collector);
+                ::lua_pushvalue(pL, -1);
+                ::lua_rawsetp(pL, LUA_REGISTRYINDEX, &s_keysKey);
+            }
+        }
+
+        static int to_lua(lua_State * pL, const T & value)
+        {
+            //字段名数组, table, 键, 值
+            ::luaL_checkstack(pL, 4, "too many nested tables");
+            PushKeys(pL);
+            int keysIndex = ::lua_gettop(pL);
+            ::lua_createtable(pL, 0, FieldCount());
+            LuaStructWriter<T> writer = { pL, value, keysIndex, keysIndex + 1, 0 };
+            lua_struct_map<T>::visit(writer);
+            lua_remove(pL, keysIndex);
+            return 1;
+        }
+
+        static T from_lua(lua_State * pL, int index, T defaultValue = T{})
+        {
+            if ((::lua_type(pL, index) != LUA_TTABLE) || !::lua_checkstack(pL, 3))
+            {
+                return defaultValue;
+            }
+            index = ::lua_absindex(pL, index);
+            T result{};
+            PushKeys(pL);
+            LuaStructReader<T> reader = { pL, result, ::lua_gettop(pL), index, 0 };
+            lua_struct_map<T>::visit(reader);
+            ::lua_pop(pL, 1);
+            return result;
+        }
+    };
+
+    template<class T>
+    const char LuaStructDispatcher<T>::s_keysKey = 0;
+}
+
+/** 开始一个结构体的映射, 必须在全局命名空间中使用
+@param[in] structType: 结构体类型, 要有默认构造函数, 字段可以赋值
+*/
+#define BEGIN_LUA_STRUCT_MAP_IMPLEMENT(structType) \
+SHARELIB_BEGIN_NAMESPACE \
+template<> \
+struct lua_io_dispatcher<structType, false> \
+    : public Internal::LuaStructDispatcher<structType> \
+{ \
+}; \
+template<> \
+struct lua_type_of<structType> \
+    : public std::integral_constant<int, LUA_TTABLE> \
+{ \
+}; \
+template<> \
+struct lua_struct_map<structType> \
+{ \
+    using struct_type = structType; \
+    template<class _Visitor> \
+    static void visit(_Visitor & visitor) \
+    {
+
+/** 映射一个字段, lua中的键名与字段名相同
+@param[in] field: 字段名, 不加引号
+*/
+#define ENTRY_LUA_STRUCT_FIELD_IMPLEMENT(field) \
+        visitor(#field, &struct_type::field);
+
+/** 映射一个字段, 指定lua中的键名
+@param[in] luaName: lua中的键名, const char *
+@param[in] field: 字段名, 不加引号
+*/
+#define ENTRY_LUA_STRUCT_FIELD_NAME_IMPLEMENT(luaName, field) \
+        visitor(luaName, &struct_type::field);
+
+/** 结束结构体的映射
+*/
+#define END_LUA_STRUCT_MAP_IMPLEMENT() \
+    } \
+}; \
+SHARELIB_END_NAMESPACE
+
+SHARELIB_END_NAMESPACE
@@ -7,13 +7,29 @@ version: 1.0
 #include <cstdint>
 #include <initializer_list>
 #include <memory>
+#include <tuple>
 #include <type_traits>
+#include <utility>
 #include "MacroDefBase.h"
 #include "lua_iostream.h"
+#include "lua_class.h"
+#include "lua_stl_dispatcher.h"
+#include "lua_struct_map.h"
+#include "lua_chunk_cache.h"
 #include "MetaUtility.h"
 
 SHARELIB_BEGIN_NAMESPACE
 
+/* C++调用的参数检查方式, 每个绑定单独选择, 与NDEBUG无关:
+FAST: 不做额外检查, 类型不符的参数取默认值, 成员调用的对象指针为空时不调用;
+CHECKED: 调用前检查每个参数的lua类型, 不符时用luaL_argerror抛出lua错误, 给出参数序号和期望的类型.
+*/
+enum class lua_arg_policy
+{
+    FAST,
+    CHECKED,
+};
+
 //----lua调用C++的转接辅助---------------------------------------------
 namespace Internal
 {
@@ -42,6 +58,59 @@ namespace Internal
     {
     };
 
+//----返回值压栈, std::tuple和std::pair展开为多个返回值, 不创建table----------------
+
+    template<class T>
+    struct LuaReturnValue
+    {
+        template<class U>
+        static int Push(lua_State * pLua, U && value)
+        {
+            return lua_io_dispatcher<T>::to_lua(pLua, std::forward<U>(value));
+        }
+    };
+
+    //压入一个返回值, 转换失败时压入nil, 保持后面返回值的位置
+    template<class T, class U>
+    int PushReturnElement(lua_State * pLua, U && value)
+    {
+        if (lua_io_dispatcher<T>::to_lua(pLua, std::forward<U>(value)) == 0)
+        {
+            ::lua_pushnil(pLua);
+        }
+        return 1;
+    }
+
+    template<class _Tuple, class _IndexType>
+    struct LuaMultiReturnValue;
+
+    template<class _Tuple, size_t ... index>
+    struct LuaMultiReturnValue<_Tuple, IntegerSequence<index...> >
+    {
+        template<class U>
+        static int Push(lua_State * pLua, U && value)
+        {
+            (void)value;
+            ::luaL_checkstack(pLua, (int)sizeof...(index), "too many results");
+            int dummy[] = { 0, PushReturnElement<std::decay_t<typename std::tuple_element<index, _Tuple>::type> >(
+                pLua, std::get<index>(std::forward<U>(value)))... };
+            (void)dummy;
+            return (int)sizeof...(index);
+        }
+    };
+
+    template<class ...T>
+    struct LuaReturnValue<std::tuple<T...> >
+        : public LuaMultiReturnValue<std::tuple<T...>, typename MakeSequence<sizeof...(T)>::type>
+    {
+    };
+
+    template<class T1, class T2>
+    struct LuaReturnValue<std::pair<T1, T2> >
+        : public LuaMultiReturnValue<std::pair<T1, T2>, typename MakeSequence<2>::type>
+    {
+    };
+
 //----分普通函数, 成员函数, 成员变量 返回值是否为void, 区分调用------------------------------------------
 
     /** lua调用分发器
@@ -76,7 +145,7 @@ namespace Internal
         static int Execute(lua_State * pLua, _PfType pfn)
         {
             using result_type = std::decay_t<typename _CallableType::result_t>;
-            return lua_io_dispatcher<result_type>::to_lua(
+            return LuaReturnValue<result_type>::Push(
                 pLua,
                 pfn(lua_io_dispatcher<
                     std::decay_t<typename std::tuple_element<index, typename _CallableType::arg_tuple_t>::type >
@@ -94,7 +163,6 @@ namespace Internal
         {
             using class_type = std::decay_t<typename _CallableType::class_t>;
             class_type * pThis = lua_io_dispatcher<class_type*>::from_lua(pLua, 1);
-            assert(pThis);
             if (pThis)
             {
                 (pThis->*pmf)(lua_io_dispatcher <
@@ -115,10 +183,9 @@ namespace Internal
             using result_type = std::decay_t<typename _CallableType::result_t>;
             using class_type = std::decay_t<typename _CallableType::class_t>;
             class_type * pThis = lua_io_dispatcher<class_type*>::from_lua(pLua, 1);
-            assert(pThis);
             if (pThis)
             {
-                return lua_io_dispatcher<result_type>::to_lua(
+                return LuaReturnValue<result_type>::Push(
                     pLua,
                     (pThis->*pmf)(lua_io_dispatcher<
                         std::decay_t<typename std::tuple_element<index, typename _CallableType::arg_tuple_t>::type>
@@ -142,10 +209,9 @@ namespace Internal
             using result_type = std::decay_t<typename _CallableType::result_t>;
             using class_type = std::decay_t<typename _CallableType::class_t>;
             class_type * pThis = lua_io_dispatcher<class_type*>::from_lua(pLua, 1);
-            assert(pThis);
             if (pThis)
             {
-                return lua_io_dispatcher<result_type>::to_lua(
+                return LuaReturnValue<result_type>::Push(
                     pLua,
                     pThis->*pmd
                     );
@@ -179,7 +245,7 @@ namespace Internal
         static int Execute(lua_State * pLua, _PfType && fnObj)
         {
             using result_type = std::decay_t<typename _CallableType::result_t>;
-            return lua_io_dispatcher<result_type>::to_lua(
+            return LuaReturnValue<result_type>::Push(
                 pLua,
                 fnObj(lua_io_dispatcher<
                     std::decay_t<typename std::tuple_element<index, typename _CallableType::arg_tuple_t>::type>
@@ -190,35 +256,309 @@ namespace Internal
 
 //----lua C函数的适配函数入口----------------------------------------
 
-    //lua调用C的主函数,所有的C++调用都从这里转发出去
-    template<class _CallType, bool bTrivialDestructor>
-    int MainLuaCFunctionCall(lua_State * pLua)
+    //执行构造在userdata中的C++调用
+    template<class _CallType>
+    int InvokeCppCallable(lua_State * pLua, void * ppf)
     {
-        //upvalue中第一个值固定为真实执行的调用值
-        void * ppf = ::lua_touserdata(pLua, lua_upvalueindex(1));
         assert(ppf);
         using _Call_Helper = CallableTypeHelper<_CallType>;
         CheckCFuncArgValid<typename _Call_Helper::arg_tuple_t> checkParam;
         (void)checkParam;
-        bool bTrivial = bTrivialDestructor;//avoid warning
-        if (bTrivial)
+        return luaCFunctionDispatcher<
+            _Call_Helper::call_type,
+            std::is_void<typename _Call_Helper::result_t>::value,
+            _Call_Helper,
+            typename _Call_Helper::arg_index_t>::Execute(pLua, *(_CallType*)ppf);
+    }
+
+    //异步调用(见lua_async.h)的返回值压栈后返回该值, 由主函数挂起协程
+    const int LUA_CPP_CALL_YIELD = -1;
+
+    //栈顶是异步操作, 挂起当前协程; 不在协程中时同步等待结果. 在lua_async.cpp中实现
+    int LuaAsyncYield(lua_State * pLua);
+
+    inline int FinishCppCall(lua_State * pLua, int nResults)
+    {
+        return (nResults != LUA_CPP_CALL_YIELD) ? nResults : LuaAsyncYield(pLua);
+    }
+
+    //lua调用C的主函数,所有的C++调用都从这里转发出去
+    template<class _CallType>
+    int MainLuaCFunctionCall(lua_State * pLua)
+    {
+        //upvalue中第一个值固定为真实执行的调用值, 调用对象直接构造在userdata中
+        return FinishCppCall(pLua,
+            InvokeCppCallableCatching(pLua, InvokeCppCallable<_CallType>, ::lua_touserdata(pLua, lua_upvalueindex(1))));
+    }
+
+//----重载: 一个名字对应多个C++调用, 按参数个数和类型选择----------------------
+
+    //参数的lua类型表, 末尾多一个LUA_TNONE, 避免空数组
+    template<class _ArgTuple>
+    struct LuaArgTypeList;
+
+    template<class ...T>
+    struct LuaArgTypeList<std::tuple<T...> >
+    {
+        static const int s_count = sizeof...(T);
+        static const int s_types[sizeof...(T) + 1];
+    };
+
+    template<class ...T>
+    const int LuaArgTypeList<std::tuple<T...> >::s_types[sizeof...(T) + 1] = {
+        lua_type_of<std::decay_t<T> >::value..., LUA_TNONE };
+
+    template<class T, class _Tuple>
+    struct TuplePushFront;
+
+    template<class T, class ...Rest>
+    struct TuplePushFront<T, std::tuple<Rest...> >
+    {
+        using type = std::tuple<T, Rest...>;
+    };
+
+    //lua中调用时的参数列表, 成员函数和成员变量的第一个参数是对象指针
+    template<class _CallableType,
+        bool isMember = (_CallableType::call_type == CallType::POINTER_TO_MEMBER_FUNCTION)
+                     || (_CallableType::call_type == CallType::POINTER_TO_MEMBER_DATA)>
+    struct OverloadSignature
+        : public LuaArgTypeList<typename _CallableType::arg_tuple_t>
+    {
+    };
+
+    template<class _CallableType>
+    struct OverloadSignature<_CallableType, true>
+        : public LuaArgTypeList<typename TuplePushFront<
+            typename _CallableType::class_t *, typename _CallableType::arg_tuple_t>::type>
+    {
+    };
+
+    //分发表中的一项
+    struct OverloadEntry
+    {
+        int(*m_pfnInvoke)(lua_State *, void *);
+        int m_nArgs;
+        const int * m_pArgTypes;
+    };
+
+    //按栈上的参数查找匹配的重载, 返回下标, 没有匹配的返回-1
+    int MatchOverload(lua_State * pLua, const OverloadEntry * pEntries, int nCount);
+
+    //抛出lua错误, 列出实际参数和所有候选, 不返回
+    int RaiseOverloadError(lua_State * pLua, const OverloadEntry * pEntries, int nCount);
+
+    /* 重载集合, 分发表在编译期生成. 第i个调用对象在第i+1个upvalue中.
+    参数个数和类型都相同时, 先注册的优先.
+    */
+    template<class ..._CallTypes>
+    struct OverloadSet
+    {
+        static const OverloadEntry s_entries[sizeof...(_CallTypes)];
+
+        static int Dispatch(lua_State * pLua)
         {
-            return luaCFunctionDispatcher<
-                _Call_Helper::call_type,
-                std::is_void<typename _Call_Helper::result_t>::value,
-                _Call_Helper,
-                typename _Call_Helper::arg_index_t>::Execute(pLua, *(_CallType*)ppf);
+            int nIndex = MatchOverload(pLua, s_entries, (int)sizeof...(_CallTypes));
+            if (nIndex < 0)
+            {
+                return RaiseOverloadError(pLua, s_entries, (int)sizeof...(_CallTypes));
+            }
+            return FinishCppCall(pLua, InvokeCppCallableCatching(pLua, s_entries[nIndex].m_pfnInvoke,
+                ::lua_touserdata(pLua, lua_upvalueindex(nIndex + 1))));
         }
-        else
+    };
+
+    template<class ..._CallTypes>
+    const OverloadEntry OverloadSet<_CallTypes...>::s_entries[sizeof...(_CallTypes)] = {
+        {
+            InvokeCppCallable<_CallTypes>,
+            OverloadSignature<CallableTypeHelper<_CallTypes> >::s_count,
+            OverloadSignature<CallableTypeHelper<_CallTypes> >::s_types
+        }...
+    };
+
+//----参数检查, lua_arg_policy::CHECKED时使用----------------------------
+
+    //检查index处的参数, 合法时返回nullptr, 否则返回期望的类型名
+    typedef const char * (*LuaArgCheckFunc)(lua_State *, int);
+
+    //按lua_type_of比较类型
+    template<class T,
+        int luaType = lua_type_of<T>::value,
+        bool isInteger = std::is_integral<T>::value && !std::is_same<T, bool>::value>
+    struct LuaArgChecker
+    {
+        static const char * Check(lua_State * pLua, int index)
+        {
+            return (::lua_type(pLua, index) == luaType) ? nullptr : ::lua_typename(pLua, luaType);
+        }
+    };
+
+    //任意类型
+    template<class T>
+    struct LuaArgChecker<T, LUA_TNONE, false>
+    {
+        static const char * Check(lua_State *, int)
+        {
+            return nullptr;
+        }
+    };
+
+    //整数, 浮点数要能无损转换
+    template<class T>
+    struct LuaArgChecker<T, LUA_TNUMBER, true>
+    {
+        static const char * Check(lua_State * pLua, int index)
+        {
+            int isNum = 0;
+            if (::lua_type(pLua, index) == LUA_TNUMBER)
+            {
+                (void)::lua_tointegerx(pLua, index, &isNum);
+            }
+            return isNum ? nullptr : "integer";
+        }
+    };
+
+    //绑定类的值
+    template<class T>
+    struct LuaArgChecker<T, LUA_TUSERDATA, false>
+    {
+        static const char * Check(lua_State * pLua, int index)
+        {
+            const LuaClassInfo * pInfo = &LuaClassInfoOf<T>::s_info;
+            return LuaClassCheckCast(pLua, index, pInfo) ? nullptr : LuaClassName(pLua, pInfo);
+        }
+    };
+
+    //指针参数, 可以为nil; lightuserdata不检查类型, 与LuaPointerDispatcher一致
+    template<class T, bool isBound = lua_class_traits<std::remove_cv_t<T> >::is_bound>
+    struct LuaPointerArgChecker
+    {
+        static const char * Check(lua_State * pLua, int index)
+        {
+            return lua_isnoneornil(pLua, index) || (::lua_type(pLua, index) == LUA_TLIGHTUSERDATA) ?
+                nullptr : "lightuserdata";
+        }
+    };
+
+    template<class T>
+    struct LuaPointerArgChecker<T, true>
+    {
+        static const char * Check(lua_State * pLua, int index)
+        {
+            const LuaClassInfo * pInfo = &LuaClassInfoOf<std::remove_cv_t<T> >::s_info;
+            if (lua_isnoneornil(pLua, index)
+                || (::lua_type(pLua, index) == LUA_TLIGHTUSERDATA)
+                || LuaClassCheckCast(pLua, index, pInfo))
+            {
+                return nullptr;
+            }
+            return LuaClassName(pLua, pInfo);
+        }
+    };
+
+    //成员调用的对象指针, 不能为空
+    template<class T>
+    struct LuaSelfArg
+    {
+    };
+
+    template<class T, bool isBound = lua_class_traits<std::remove_cv_t<T> >::is_bound>
+    struct LuaSelfArgChecker
+    {
+        static const char * Check(lua_State * pLua, int index)
+        {
+            return (::lua_type(pLua, index) == LUA_TLIGHTUSERDATA) && ::lua_touserdata(pLua, index) ?
+                nullptr : "lightuserdata";
+        }
+    };
+
+    template<class T>
+    struct LuaSelfArgChecker<T, true>
+    {
+        static const char * Check(lua_State * pLua, int index)
         {
-            using _FuncObj_Store_t = std::shared_ptr<void>;
-            _FuncObj_Store_t * pSpObj = (_FuncObj_Store_t*)ppf;
-            return luaCFunctionDispatcher<
-                _Call_Helper::call_type,
-                std::is_void<typename _Call_Helper::result_t>::value,
-                _Call_Helper,
-                typename _Call_Helper::arg_index_t>::Execute(pLua, *(_CallType*)(pSpObj->get()));
+            const LuaClassInfo * pInfo = &LuaClassInfoOf<std::remove_cv_t<T> >::s_info;
+            if (((::lua_type(pLua, index) == LUA_TLIGHTUSERDATA) && ::lua_touserdata(pLua, index))
+                || LuaClassCheckCast(pLua, index, pInfo))
+            {
+                return nullptr;
+            }
+            return LuaClassName(pLua, pInfo);
         }
+    };
+
+    template<class T>
+    struct LuaArgCheckerOf
+    {
+        using type = LuaArgChecker<T>;
+    };
+
+    //字符串指针按类型比较, 其他指针按LuaPointerArgChecker
+    template<class T>
+    struct LuaArgCheckerOf<T*>
+    {
+        using type = std::conditional_t<lua_type_of<T*>::value == LUA_TSTRING,
+            LuaArgChecker<T*>,
+            LuaPointerArgChecker<T> >;
+    };
+
+    template<class T>
+    struct LuaArgCheckerOf<LuaSelfArg<T> >
+    {
+        using type = LuaSelfArgChecker<T>;
+    };
+
+    //参数的检查函数表, 末尾为nullptr
+    template<class _ArgTuple>
+    struct LuaArgCheckList;
+
+    template<class ...T>
+    struct LuaArgCheckList<std::tuple<T...> >
+    {
+        static const LuaArgCheckFunc s_checks[sizeof...(T) + 1];
+    };
+
+    template<class ...T>
+    const LuaArgCheckFunc LuaArgCheckList<std::tuple<T...> >::s_checks[sizeof...(T) + 1] = {
+        &LuaArgCheckerOf<std::decay_t<T> >::type::Check..., nullptr };
+
+    //lua中调用时的参数列表, 成员函数和成员变量的第一个参数是对象指针
+    template<class _CallableType,
+        bool isMember = (_CallableType::call_type == CallType::POINTER_TO_MEMBER_FUNCTION)
+                     || (_CallableType::call_type == CallType::POINTER_TO_MEMBER_DATA)>
+    struct LuaArgCheckSignature
+        : public LuaArgCheckList<typename _CallableType::arg_tuple_t>
+    {
+    };
+
+    template<class _CallableType>
+    struct LuaArgCheckSignature<_CallableType, true>
+        : public LuaArgCheckList<typename TuplePushFront<
+            LuaSelfArg<typename _CallableType::class_t>, typename _CallableType::arg_tuple_t>::type>
+    {
+    };
+
+    //按检查函数表依次检查参数, 不合法时抛出lua错误, 不返回
+    void CheckLuaArgs(lua_State * pLua, const LuaArgCheckFunc * pChecks);
+
+    //lua_arg_policy::CHECKED的主函数, 先检查参数再调用
+    template<class _CallType>
+    int MainLuaCFunctionCheckedCall(lua_State * pLua)
+    {
+        CheckLuaArgs(pLua, LuaArgCheckSignature<CallableTypeHelper<_CallType> >::s_checks);
+        return MainLuaCFunctionCall<_CallType>(pLua);
+    }
+
+    template<class _CallType>
+    lua_CFunction SelectMainLuaCFunction(std::integral_constant<lua_arg_policy, lua_arg_policy::FAST>)
+    {
+        return MainLuaCFunctionCall<_CallType>;
+    }
+
+    template<class _CallType>
+    lua_CFunction SelectMainLuaCFunction(std::integral_constant<lua_arg_policy, lua_arg_policy::CHECKED>)
+    {
+        return MainLuaCFunctionCheckedCall<_CallType>;
     }
 
 //----分情况注册回调函数--------------------------------------------------
@@ -232,6 +572,31 @@ namespace Internal
         return 0;
     }
 
+    //每个类型一个垃圾回收元表, 以静态变量的地址为key保存在注册表中, 避免每次按名字查找
+    template<class T>
+    struct FunctionObjectGcMetatable
+    {
+        static const char s_key;
+
+        //把元表压入栈顶, 第一次使用时创建
+        static void Push(lua_State * pLua)
+        {
+            if (LUA_TTABLE != ::lua_rawgetp(pLua, LUA_REGISTRYINDEX, &s_key))
+            {
+                ::lua_pop(pLua, 1);
+                ::lua_createtable(pLua, 0, 1);
+                ::lua_pushcfunction(pLua, FunctionObjectGcHelper<T>);
+                ::lua_setfield(pLua, -2, "__gc");
+                ::lua_pushvalue(pLua, -1);
+                ::lua_rawsetp(pLua, LUA_REGISTRYINDEX, &s_key);
+            }
+        }
+    };
+
+    template<class T>
+    const char FunctionObjectGcMetatable<T>::s_key = 0;
+
+    //把调用对象构造在userdata中, 压入栈顶
     template<bool bTrivialDestructor = true>
     struct PushCppCallableDispatcher
     {
@@ -240,10 +605,11 @@ namespace Internal
         static void PushImpl(lua_State * pLua, _CallType && pf)
         {
             using _Call_t = std::decay_t<_CallType>;
+            static_assert(std::alignment_of<_Call_t>::value <= std::alignment_of<LuaMaxAlign>::value,
+                "over-aligned callable object is not supported");
             _Call_t * ppf = (_Call_t *)::lua_newuserdata(pLua, sizeof(_Call_t));
             assert(ppf);
             ::new (ppf)_Call_t(std::forward<_CallType>(pf));
-            ::lua_pushcclosure(pLua, MainLuaCFunctionCall<_Call_t, true>, 1);
         }
     };
 
@@ -255,23 +621,36 @@ namespace Internal
         static void PushImpl(lua_State * pLua, _CallType && pf)
         {
             using _Call_t = std::decay_t<_CallType>;
-            using _FuncObj_Store_t = std::shared_ptr<void>;
-            _FuncObj_Store_t * pObj = (_FuncObj_Store_t *)::lua_newuserdata(pLua, sizeof(_FuncObj_Store_t));
-            ::new (pObj)_FuncObj_Store_t();
-            *pObj = std::make_shared<_Call_t>(std::forward<_CallType>(pf));
-            if (::luaL_newmetatable(pLua, "{BEB170D0-0C27-4AE7-9891-6487B608C7C5}") > 0)
-            {
-                //创建元表进行垃圾回收,一个元表只有一个垃圾回收实现,但元表中关联的userdata有多种,
-                //因此使用shared_ptr<void>封装,进行统一析构
-                ::lua_pushcfunction(pLua, FunctionObjectGcHelper<_FuncObj_Store_t>);
-                ::lua_setfield(pLua, -2, "__gc");
-            }
-            //关联userdata到垃圾回收元表中
+            static_assert(std::alignment_of<_Call_t>::value <= std::alignment_of<LuaMaxAlign>::value,
+                "over-aligned callable object is not supported");
+            _Call_t * ppf = (_Call_t *)::lua_newuserdata(pLua, sizeof(_Call_t));
+            assert(ppf);
+            ::new (ppf)_Call_t(std::forward<_CallType>(pf));
+            //构造成功后再关联析构用的元表
+            FunctionObjectGcMetatable<_Call_t>::Push(pLua);
             ::lua_setmetatable(pLua, -2);
             assert(LUA_TUSERDATA == ::lua_type(pLua, -1));
-            ::lua_pushcclosure(pLua, MainLuaCFunctionCall<_Call_t, false>, 1);
         }
     };
+
+    template<class _CallType>
+    void PushCppCallableObject(lua_State * pLua, _CallType && pf)
+    {
+        PushCppCallableDispatcher<
+            std::is_trivially_destructible<std::decay_t<_CallType> >::value
+            >::PushImpl(pLua, std::forward<_CallType>(pf));
+    }
+
+    inline void PushCppCallableObjects(lua_State *)
+    {
+    }
+
+    template<class _CallType, class ...Rest>
+    void PushCppCallableObjects(lua_State * pLua, _CallType && pf, Rest && ... rest)
+    {
+        PushCppCallableObject(pLua, std::forward<_CallType>(pf));
+        PushCppCallableObjects(pLua, std::forward<Rest>(rest)...);
+    }
 }
 
 /** 向栈上压入C++调用
@@ -279,14 +658,33 @@ namespace Internal
 @param[in] pf C++ callable object, restriction: support "copy construct(left value)"
               or "move construct(right value)". 
               The callable object can't have left value reference parameter.
+@Tparam[in] policy 参数检查方式, 见lua_arg_policy
 */
-template<class _CallType>
+template<lua_arg_policy policy = lua_arg_policy::FAST, class _CallType>
 void push_cpp_callable_to_lua(lua_State * pLua, _CallType && pf)
 {
-    ::luaL_checkstack(pLua, 1, "too many upvalues");
-    Internal::PushCppCallableDispatcher<
-        std::is_trivially_destructible<std::decay_t<_CallType> >::value
-        >::PushImpl(pLua, std::forward<_CallType>(pf));
+    ::luaL_checkstack(pLua, 2, "too many upvalues");
+    Internal::PushCppCallableObject(pLua, std::forward<_CallType>(pf));
+    ::lua_pushcclosure(pLua,
+        Internal::SelectMainLuaCFunction<std::decay_t<_CallType> >(
+            std::integral_constant<lua_arg_policy, policy>()),
+        1);
+}
+
+/** 向栈上压入一组重载的C++调用, lua中调用时按参数个数和lua_type选择其中一个, 
+都不匹配时抛出lua错误, 列出所有候选. 参数类型与lua类型的对应见lua_type_of.
+@param[in,out] pLua  pointer of lua_Satate
+@param[in] pfs 多个C++调用, 限制与push_cpp_callable_to_lua相同
+*/
+template<class ..._CallTypes>
+void push_cpp_overloads_to_lua(lua_State * pLua, _CallTypes && ... pfs)
+{
+    static_assert(sizeof...(_CallTypes) > 0 && sizeof...(_CallTypes) < 256, "invalid overload count");
+    ::luaL_checkstack(pLua, (int)sizeof...(_CallTypes) + 1, "too many upvalues");
+    Internal::PushCppCallableObjects(pLua, std::forward<_CallTypes>(pfs)...);
+    ::lua_pushcclosure(pLua,
+        Internal::OverloadSet<std::decay_t<_CallTypes>...>::Dispatch,
+        (int)sizeof...(_CallTypes));
 }
 
 
@@ -303,8 +701,13 @@ void push_cpp_callable_to_lua(lua_State * pLua, _CallType && pf)
    这里实际发生的处理顺序是, Derived* 转成 void*存入lua, 执行lua脚本时, 从lua中取出void*转成Base*,而后
    调用成员函数,因此如果经过这个转换之后指针不正确,那么就会出问题.比如Derived类从A和B继承,A在前,B在后,
    注册了一个B中的成员函数,传入的是Derived*,该指针转成void*后再转成B*,这时候就是不正确的.
+   用lua_class.h绑定的类按userdata传递, 带有类型信息, 会正确转换为基类指针, 没有这个问题.
 4. 如果C++调用的参数列表中有默认值, 默认值不会生效.
 5. 不支持C语言风格的可变数量参数
+6. 一个名字可以注册多个C++调用(重载), 调用时按参数个数和类型选择, 见push_cpp_overloads_to_lua.
+7. C++调用返回std::tuple或std::pair时, lua中得到多个返回值, 不创建table; 作为参数或容器元素时仍对应数组table.
+8. 默认不检查参数类型, 不符时取默认值; 用ENTRY_LUA_CPP_MAP_CHECKED_IMPLEMENT注册的调用会检查, 见lua_arg_policy.
+9. 返回std::future的C++调用是异步的: 在协程中调用时挂起协程, 结果就绪后由宿主恢复, 见lua_async.h.
 */
 
 /** 定义一个注册函数
@@ -328,19 +731,101 @@ void registerFuncName(lua_State * pLua) \
     shr::push_cpp_callable_to_lua(pLua, cppCallable); \
     ::lua_setfield(pLua, -2, luaFuncName);
 
+/** 同ENTRY_LUA_CPP_MAP_IMPLEMENT, 调用前检查参数类型(lua_arg_policy::CHECKED), 用于不可信的脚本
+@param[in] luaFuncName: lua脚本中调用时所用的名字, const char *
+@param[in] cppCallable: C++调用
+*/
+#define ENTRY_LUA_CPP_MAP_CHECKED_IMPLEMENT(luaFuncName, cppCallable) \
+    shr::push_cpp_callable_to_lua<shr::lua_arg_policy::CHECKED>(pLua, cppCallable); \
+    ::lua_setfield(pLua, -2, luaFuncName);
+
+/** 添加一组重载的C++调用到lua, 与一个字符串关联起来
+@param[in] luaFuncName: lua脚本中调用时所用的名字, const char *
+@param[in] ...: 多个C++调用, 由push_cpp_overloads_to_lua实现
+*/
+#define ENTRY_LUA_CPP_OVERLOAD_IMPLEMENT(luaFuncName, ...) \
+    shr::push_cpp_overloads_to_lua(pLua, __VA_ARGS__); \
+    ::lua_setfield(pLua, -2, luaFuncName);
+
 /** 结束注册函数
 */
 #define END_LUA_CPP_MAP_IMPLEMENT() \
     ::lua_setglobal(pLua, pLib); \
 }
 
+//----lua函数的引用---------------------------------------------------------
+
+/* lua注册表中一个lua函数的引用(luaL_ref), 比如编译好的脚本, 只在创建它的lua_State中有效.
+只是一个整数句柄, 不管理生命期: 不再使用时调用lua_state_wrapper::unload_chunk释放,
+lua_State关闭时全部自动释放.
+*/
+class lua_function_ref
+{
+public:
+    lua_function_ref()
+        : m_ref(LUA_NOREF)
+    {
+    }
+
+    explicit lua_function_ref(int ref)
+        : m_ref(ref)
+    {
+    }
+
+    int get() const
+    {
+        return m_ref;
+    }
+
+    bool valid() const
+    {
+        return (m_ref != LUA_NOREF) && (m_ref != LUA_REFNIL);
+    }
+
+private:
+    int m_ref;
+};
+
+namespace Internal
+{
+    //依次把C++参数压入lua栈, 返回压入的个数
+    inline int PushLuaArgs(lua_State * pLua)
+    {
+        (void)pLua;
+        return 0;
+    }
+
+    template<class T, class ...Rest>
+    int PushLuaArgs(lua_State * pLua, T && arg, Rest && ... rest)
+    {
+        int n = lua_io_dispatcher<std::decay_t<T>>::to_lua(pLua, arg);
+        return n + PushLuaArgs(pLua, std::forward<Rest>(rest)...);
+    }
+
+    //从firstIndex开始, 把lua栈上连续的值依次读取到tuple中
+    template<class _TupleType, size_t ... index>
+    void ReadLuaResults(lua_State * pLua, int firstIndex, _TupleType & results, IntegerSequence<index...>)
+    {
+        (void)pLua;
+        (void)firstIndex;
+        (void)results;
+        int expand[] = { 0, (std::get<index>(results) = lua_io_dispatcher<
+            std::decay_t<typename std::tuple_element<index, _TupleType>::type>
+            >::from_lua(pLua, firstIndex + (int)index), 0)... };
+        (void)expand;
+    }
+}
+
 //----lua_State的封装类---------------------------------------------------------
 
+class lua_memory_quota;
+
 class lua_state_wrapper
 {
     SHARELIB_DISABLE_COPY_CLASS(lua_state_wrapper);
 
     lua_State * m_pLuaState;
+    lua_function_ref m_chunk; //load_lua_xxx加载的脚本
 public:
 
     lua_state_wrapper();
@@ -348,6 +833,16 @@ public:
     lua_state_wrapper(lua_state_wrapper&& lua2);
     lua_state_wrapper& operator=(lua_state_wrapper&& lua2);
     bool create();
+
+    /** 用指定的内存分配函数创建lua_State, 内存不足时create失败, 不会panic
+    @param[in] pfnAlloc 分配函数, 规则同lua_newstate
+    @param[in] pAllocUd 传给pfnAlloc的参数, 必须比lua_State后销毁
+    */
+    bool create(lua_Alloc pfnAlloc, void * pAllocUd);
+
+    //统计并限制内存, 见lua_allocator.h
+    bool create(lua_memory_quota & quota);
+
     void close();
     void attach(lua_State * pState);
     lua_State * detach();
@@ -379,7 +874,7 @@ public:
     void * alloc_user_data(const char * pName, size_t size);
 
     //set a global function(function object), it's name is pFuncName
-    template<class T>
+    template<lua_arg_policy policy = lua_arg_policy::FAST, class T>
     void set_global_function(const char * pFuncName, T && pf)
     {
         assert(m_pLuaState);
@@ -387,7 +882,21 @@ public:
         if (m_pLuaState && pFuncName)
         {
             lua_stack_guard_checker check(m_pLuaState);
-            push_cpp_callable_to_lua(m_pLuaState, std::forward<T>(pf));
+            push_cpp_callable_to_lua<policy>(m_pLuaState, std::forward<T>(pf));
+            ::lua_setglobal(m_pLuaState, pFuncName);
+        }
+    }
+
+    //set a global function with overloads, see push_cpp_overloads_to_lua
+    template<class ...T>
+    void set_global_overloads(const char * pFuncName, T && ... pfs)
+    {
+        assert(m_pLuaState);
+        assert(pFuncName);
+        if (m_pLuaState && pFuncName)
+        {
+            lua_stack_guard_checker check(m_pLuaState);
+            push_cpp_overloads_to_lua(m_pLuaState, std::forward<T>(pfs)...);
             ::lua_setglobal(m_pLuaState, pFuncName);
         }
     }
@@ -400,21 +909,128 @@ public:
     bool do_lua_string(const char * pString);
     bool do_lua_string(const wchar_t * pString);
 
-    //下面两个,只加载不执行,而后可以多次执行，run(),两种类型的执行脚本方法不可混用.
-    bool load_lua_file(const char * pFileName);
-    bool load_lua_file(const wchar_t * pFileName);
+    /* 下面两个,只加载不执行,而后可以多次执行，run(),两种类型的执行脚本方法不可混用.
+    加载文件时可以传入一个lua_chunk_cache, 同一个文件加载到多个lua_State时只编译一次.
+    失败时错误信息留在栈上, 可用get_error_msg获取.
+    */
+    bool load_lua_file(const char * pFileName, lua_chunk_cache * pCache = nullptr);
+    bool load_lua_file(const wchar_t * pFileName, lua_chunk_cache * pCache = nullptr);
     bool load_lua_string(const char * pString);
     bool load_lua_string(const wchar_t * pString);
 
+    /** 直接编译内存中的脚本, 不复制也不要求以'\0'结尾
+    @param[in] pBuffer 脚本内容, 可以是源码或者lua_dump生成的字节码
+    @param[in] len 脚本长度
+    @param[in] pChunkName 脚本名字, 用于错误信息及调试信息, 规则同lua_load; nullptr时为"=(load)"
+    */
+    bool load_lua_string(const char * pBuffer, size_t len, const char * pChunkName = nullptr);
+
     /* 执行.
     本质上是把加载的lua脚本转变成lua函数,因此多次执行的lua上下文是相同的. 比如, 一个全局变量初始为0，
     第一次执行把它加1，那么第二次执行时它就是1，而不是初始值0.
     */
     bool run();
 
+    /* 一个lua_State中可以同时保存任意多个编译好的脚本, 每个脚本用一个句柄表示, 执行时直接从注册表中
+    按整数索引取出, 没有全局变量的查找. 失败时返回无效的句柄, 错误信息留在栈上, 可用get_error_msg获取.
+    与load_lua_xxx加载的脚本互不影响.
+    */
+    lua_function_ref load_chunk_file(const char * pFileName, lua_chunk_cache * pCache = nullptr);
+    lua_function_ref load_chunk_string(const char * pBuffer, size_t len, const char * pChunkName = nullptr);
+
+    //释放脚本, 之后句柄无效
+    void unload_chunk(lua_function_ref & chunk);
+
+    /* 取得一个全局lua函数的引用, 之后用call调用时直接从注册表中按整数索引取出, 不再查找全局表.
+    失败时返回无效的句柄. 不再使用时调用release_function_ref释放.
+    */
+    lua_function_ref get_function_ref(const char * pFuncName);
+    void release_function_ref(lua_function_ref & func);
+
+    /** 执行load_chunk_xxx加载的脚本, 脚本中可以用 ... 取得传入的参数
+    @param[in] chunk 脚本句柄
+    @param[in] args 传给脚本的参数, 由lua_io_dispatcher转换
+    */
+    template<class ...Args>
+    bool run(const lua_function_ref & chunk, Args && ... args)
+    {
+        assert(m_pLuaState);
+        assert(chunk.valid());
+        if (m_pLuaState && chunk.valid())
+        {
+            lua_stack_guard stateGuard(m_pLuaState);
+            if (!::lua_checkstack(m_pLuaState, (int)sizeof...(Args) + 1))
+            {
+                return false;
+            }
+            if (LUA_TFUNCTION == ::lua_rawgeti(m_pLuaState, LUA_REGISTRYINDEX, chunk.get()))
+            {
+                int nArgs = Internal::PushLuaArgs(m_pLuaState, std::forward<Args>(args)...);
+                Internal::ResetCppException(m_pLuaState);
+                Internal::LuaRunBudgetScope budgetScope(m_pLuaState);
+                if (0 == ::lua_pcall(m_pLuaState, nArgs, 0, 0))
+                {
+                    return true;
+                }
+                Internal::RethrowCppException(m_pLuaState);
+            }
+        }
+        return false;
+    }
+
+    /** C++调用lua函数
+    @Tparam[in] R 返回值类型, 多个返回值依次读取到tuple中, 返回值不足时为默认值; 不能是const wchar_t*等临时指针
+    @param[in] func get_function_ref取得的函数引用, 或者load_chunk_xxx加载的脚本
+    @param[in] args 参数, 由lua_io_dispatcher转换后直接压入lua栈
+    @return 返回值. 调用失败时为默认值, 错误信息留在栈上, 可用get_error_msg获取
+    用法: std::tuple<int, std::string> r = lua.call<int, std::string>(func, 1, "abc");
+    */
+    template<class ...R, class ...Args>
+    std::tuple<R...> call(const lua_function_ref & func, Args && ... args)
+    {
+        assert(m_pLuaState);
+        assert(func.valid());
+        std::tuple<R...> results;
+        if (m_pLuaState && func.valid())
+        {
+            ::lua_rawgeti(m_pLuaState, LUA_REGISTRYINDEX, func.get());
+            call_impl(results, std::forward<Args>(args)...);
+        }
+        return results;
+    }
+
+    //同上, 按名字调用全局lua函数
+    template<class ...R, class ...Args>
+    std::tuple<R...> call(const char * pFuncName, Args && ... args)
+    {
+        assert(m_pLuaState);
+        assert(pFuncName);
+        std::tuple<R...> results;
+        if (m_pLuaState && pFuncName)
+        {
+            ::lua_getglobal(m_pLuaState, pFuncName);
+            call_impl(results, std::forward<Args>(args)...);
+        }
+        return results;
+    }
+
     // 获取编译失败的错误信息,注意：当失败的时候才调用
     std::string get_error_msg();
 
+    /** lua调用的C++代码抛出的异常总是被转换为lua错误. 开启后还会保存原来的异常,
+    run、call失败时重新抛出, 而不是返回失败. 设置保存在lua_State中, 默认关闭
+    */
+    void set_rethrow_cpp_exception(bool bRethrow);
+
+    /** 限制每次run、call的执行量, 防止死循环等失控的脚本一直占用线程. 超出时脚本出错, 错误信息为
+    "script budget exceeded", 之后每条指令都出错, 脚本中用pcall捕获后也不能继续执行. 用LUA_MASKCOUNT的钩子实现,
+    每1000条指令检查一次, 会覆盖lua_State上已有的钩子; 设置之后创建的协程也受同一预算限制.
+    @param[in] nMaxInstructions 最多执行的虚拟机指令数, 0表示不限制
+    @param[in] nTimeoutMs 最长执行时间(毫秒), 0表示不限制. 等待C++调用返回的时间也计算在内, 但不能中断C++调用
+    两者都为0时取消限制
+    */
+    void set_run_budget(unsigned long long nMaxInstructions, unsigned int nTimeoutMs);
+
 //----执行脚本后的操作-----------------------------
 
     //获取栈中数据的个数
@@ -436,6 +1052,52 @@ public:
         }
         return defaultValue;
     }
+
+//----状态重置-----------------------------
+
+    /* 保存当前全局变量的快照, 之后reset_globals可以把全局变量恢复到这个状态, 不必关闭后重建lua_State.
+    通常在注册完C++调用、加载完脚本之后调用. 重复调用时覆盖之前的快照.
+    快照是浅复制: 只恢复全局变量本身(增加的删除, 修改的还原), 不恢复全局table内部的修改,
+    比如脚本执行了 string.xxx = 1, 重置后string.xxx仍然存在.
+    同时记录_G的元表和load_lua_xxx加载的脚本, 重置时一起恢复.
+    */
+    bool snapshot_globals();
+
+    /** 恢复到snapshot_globals时的全局变量和_G的元表, 并清空栈. 没有快照时返回false
+    快照之后load_lua_xxx加载的脚本被卸载, run执行的是快照时加载的脚本(没有时run失败);
+    load_chunk_xxx返回的引用由调用者管理, 不受影响.
+    */
+    bool reset_globals();
+
+private:
+    //加载成功时替换之前加载的脚本
+    bool set_loaded_chunk(lua_function_ref chunk);
+
+    //栈顶是要调用的lua函数
+    template<class ...R, class ...Args>
+    void call_impl(std::tuple<R...> & results, Args && ... args)
+    {
+        const int nTop = ::lua_gettop(m_pLuaState) - 1;
+        if (!::lua_checkstack(m_pLuaState, (int)(sizeof...(Args) + sizeof...(R))))
+        {
+            ::lua_settop(m_pLuaState, nTop);
+            ::lua_pushliteral(m_pLuaState, "stack overflow");
+            return;
+        }
+        int nArgs = Internal::PushLuaArgs(m_pLuaState, std::forward<Args>(args)...);
+        Internal::ResetCppException(m_pLuaState);
+        Internal::LuaRunBudgetScope budgetScope(m_pLuaState);
+        if (::lua_pcall(m_pLuaState, nArgs, (int)sizeof...(R), 0) == LUA_OK)
+        {
+            Internal::ReadLuaResults(m_pLuaState, nTop + 1, results,
+                typename MakeSequence<sizeof...(R)>::type());
+            ::lua_settop(m_pLuaState, nTop);
+        }
+        else
+        {
+            Internal::RethrowCppException(m_pLuaState);
+        }
+    }
 };
 
 SHARELIB_END_NAMESPACE
@@ -1,8 +1,18 @@
 ﻿#pragma once
 #include <cassert>
-#include "lua/src/lua.hpp"
 #include "MacroDefBase.h"
 
+/* lua源码按C++编译时定义该宏(工程属性LuaAsCpp=true), lua内部的错误改用C++异常(LUAI_THROW),
+受保护调用不再需要setjmp; 这时lua的函数不是extern "C"的, 不能用lua.hpp包含.
+*/
+#ifdef LUA_WRAPPER_LUA_AS_CPP
+#include "lua/src/lua.h"
+#include "lua/src/lualib.h"
+#include "lua/src/lauxlib.h"
+#else
+#include "lua/src/lua.hpp"
+#endif
+
 /* lua脚本使用的编码
 如果使用utf8, 定义该宏; 未定义时使用 std::local{} 的编码, 可以使用 std::locale::global修改编码
 选择哪种编码通常取决于当前编译器的默认char*编码,
@@ -67,4 +77,54 @@ private:
     int m_nCount;
 };
 
+//----userdata的对齐------------------------------------------------------
+
+namespace Internal
+{
+    //lua_newuserdata的内存按LUAI_MAXALIGN对齐, 与llimits.h中的L_Umaxalign相同
+    union LuaMaxAlign
+    {
+        lua_Number n;
+        double u;
+        void * s;
+        lua_Integer i;
+        long l;
+    };
+}
+
+//----C++异常转换为lua错误------------------------------------------------------
+
+namespace Internal
+{
+    /** 执行lua调用的C++代码, 捕获std::exception等C++异常, 转换为lua错误, 异常不会穿过lua的C代码.
+    错误信息为 "C++ exception (类型): what()", 类型名是还原后的写法(如std::runtime_error), 具体格式与编译器有关
+    (MSVC为"class std::runtime_error"). 按C++编译lua时, lua自身的错误照常传递.
+    */
+    int InvokeCppCallableCatching(lua_State * pLua, int(*pfnInvoke)(lua_State *, void *), void * ppf);
+
+    //lua_pcall之前调用, 清除上次保存的C++异常
+    void ResetCppException(lua_State * pLua);
+
+    //lua_pcall失败后调用, 开启了重新抛出且保存有C++异常时, 弹出栈顶的错误信息, 抛出原来的异常
+    void RethrowCppException(lua_State * pLua);
+}
+
+//----执行预算------------------------------------------------------
+
+namespace Internal
+{
+    /* run、call期间让lua_state_wrapper::set_run_budget设置的预算生效, 离开作用域后失效.
+    嵌套的run、call不重新计算, 共用最外层的预算.
+    */
+    class LuaRunBudgetScope
+    {
+    public:
+        explicit LuaRunBudgetScope(lua_State * pLua);
+        ~LuaRunBudgetScope();
+    private:
+        //不是最外层或者没有设置预算时为nullptr
+        void * m_pBudget;
+    };
+}
+
 SHARELIB_END_NAMESPACE
@@ -1,9 +1,15 @@
 ﻿// lua_wrapper.cpp : 定义控制台应用程序的入口点。
 //
 #include "lua_wrapper/lua_wrapper.h"
+#include "lua_wrapper/lua_allocator.h"
+#include "lua_wrapper/lua_async.h"
+#include "lua_wrapper/lua_scheduler.h"
 #include <iostream>
 #include <cassert>
+#include <chrono>
+#include <future>
 #include <string>
+#include <thread>
 #include <windows.h>
 #include <stdio.h>
 #include <tchar.h>
@@ -38,15 +44,11 @@ struct WrapCompoment
 static shr::lua_ostream & operator << (shr::lua_ostream & os, const WrapCompoment& compoment)
 {
     os << shr::lua_ostream::table_begin
-        << compoment.m_a;
-
-    shr::lua_ostream sub(os.get());
-    sub << shr::lua_ostream::table_begin
+        << compoment.m_a
+        << shr::lua_ostream::table_begin
         << compoment.m_b.left << compoment.m_b.top << compoment.m_b.right << compoment.m_b.bottom
-        << shr::lua_ostream::table_end;
-    os.insert_subtable(sub);
-
-    os << compoment.m_c
+        << shr::lua_ostream::table_end
+        << compoment.m_c
         << shr::lua_ostream::table_end;
     return os;
 }
@@ -54,14 +56,11 @@ static shr::lua_ostream & operator << (shr::lua_ostream & os, const WrapCompomen
 //重载从lua中读取WrapCompoment的输入运算符
 static shr::lua_istream & operator >> (shr::lua_istream & is, WrapCompoment& compoment)
 {
-    is >> compoment.m_a;
-    if (is.is_subtable())
-    {
-        shr::lua_istream sub(is.get(), -1);
-        sub >> compoment.m_b.left >> compoment.m_b.top >> compoment.m_b.right >> compoment.m_b.bottom;
-        is.cleanup_subtable(sub);
-    }
-    is >> compoment.m_c;
+    is >> compoment.m_a
+        >> shr::lua_istream::table_begin
+        >> compoment.m_b.left >> compoment.m_b.top >> compoment.m_b.right >> compoment.m_b.bottom
+        >> shr::lua_istream::table_end
+        >> compoment.m_c;
     return is;
 }
 
@@ -143,10 +142,183 @@ void TestLuaCpp()
     assert(bOk);
 }
 
+//返回std::future的C++调用: 协程中调用时挂起, 宿主在结果就绪后恢复
+void TestLuaAsync()
+{
+    shr::lua_state_wrapper lua;
+    bool bOk = lua.create();
+    assert(bOk);
+    lua.set_global_function("AsyncAdd", [](int a, int b) {
+        return std::async(std::launch::async, [a, b]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            return a + b;
+        });
+    });
+    bOk = lua.do_lua_string("function job(a, b) local r = AsyncAdd(a, b); return r * 2 end");
+    assert(bOk);
+
+    //不在协程中调用时同步等待
+    bOk = lua.do_lua_string("assert(AsyncAdd(1, 2) == 3)");
+    assert(bOk);
+
+    lua_State * pLua = lua;
+    lua_State * co = ::lua_newthread(pLua);
+    int coRef = ::luaL_ref(pLua, LUA_REGISTRYINDEX);
+    ::lua_getglobal(co, "job");
+    ::lua_pushinteger(co, 20);
+    ::lua_pushinteger(co, 1);
+    int status = ::lua_resume(co, pLua, 2);
+    assert(status == LUA_YIELD && shr::lua_async_pending(co));
+    while (!shr::lua_async_ready(co))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    status = shr::lua_async_resume(co, pLua);
+    assert(status == LUA_OK && ::lua_tointeger(co, -1) == 42);
+    ::luaL_unref(pLua, LUA_REGISTRYINDEX, coRef);
+}
+
+//一个lua_State中用协程运行多个任务: 轮流让出、sleep定时、等待异步C++调用
+void TestLuaScheduler()
+{
+    shr::lua_state_wrapper lua;
+    bool bOk = lua.create();
+    assert(bOk);
+    //调度器必须在lua_State关闭之前销毁
+    shr::lua_scheduler sched(lua);
+    sched.register_sleep();
+    lua.set_global_function("AsyncLoad", [](int id) {
+        return std::async(std::launch::async, [id]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            return id * 10;
+        });
+    });
+    bOk = lua.do_lua_string(
+        "log = {} "
+        "function worker(name) for i = 1, 2 do log[#log + 1] = name .. i; coroutine.yield() end end "
+        "function loader(id) local v = AsyncLoad(id); log[#log + 1] = 'load' .. v end "
+        "function timer() sleep(0.01); log[#log + 1] = 'timer' end");
+    assert(bOk);
+    auto worker = lua.get_function_ref("worker");
+    auto loader = lua.get_function_ref("loader");
+    auto timer = lua.get_function_ref("timer");
+    std::string errors;
+    sched.set_error_handler([&errors](shr::lua_scheduler::task_id_t, const char * pMsg) { errors += pMsg; });
+    sched.spawn(worker, 0, "a");
+    sched.spawn(worker, 1, "b");
+    sched.spawn(loader, 0, 7);
+    sched.spawn(timer, 0);
+    sched.run();
+    assert(errors.empty() && sched.task_count() == 0);
+
+    //优先级高的先运行, 异步调用和sleep挂起的任务不阻塞其他任务
+    bOk = lua.do_lua_string(
+        "local s = table.concat(log, ',') "
+        "assert(#log == 6 and s:find('^b1,a1,b2,a2') and s:find('load70') and s:find('timer'), s)");
+    assert(bOk);
+    lua.release_function_ref(worker);
+    lua.release_function_ref(loader);
+    lua.release_function_ref(timer);
+}
+
+//限制脚本的执行量: 失控的run出错返回, 调度器中死循环的任务被时间片打断
+void TestLuaRunBudget()
+{
+    shr::lua_state_wrapper lua;
+    bool bOk = lua.create();
+    assert(bOk);
+    bOk = lua.do_lua_string(
+        "function spin() while true do end end "
+        "function guarded() pcall(spin); survived = true end");
+    assert(bOk);
+    lua.set_run_budget(1000000, 2000);
+
+    //失败时错误信息留在栈上
+    lua.call<>("spin");
+    std::string err = lua.get_error_msg();
+    assert(err.find("script budget exceeded") != std::string::npos);
+
+    //pcall捕获预算错误后, 下一条指令仍然出错, 脚本不能继续执行
+    lua.call<>("guarded");
+    err = lua.get_error_msg();
+    assert(err.find("script budget exceeded") != std::string::npos);
+    assert(!lua.get_variable<bool>("survived", false));
+
+    //每次run重新计算预算
+    bOk = lua.load_lua_string("local s = 0 for i = 1, 1000 do s = s + i end assert(s == 500500)");
+    assert(bOk);
+    bOk = lua.run() && lua.run();
+    assert(bOk);
+    lua.set_run_budget(0, 0);
+
+    //调度器的时间片: 一直计算的任务与主动让出的任务交替运行
+    shr::lua_state_wrapper lua2;
+    bOk = lua2.create();
+    assert(bOk);
+    shr::lua_scheduler sched(lua2);
+    sched.set_time_slice(1000);
+    bOk = lua2.do_lua_string(
+        "n = 0 "
+        "function hog() for i = 1, 1000000 do n = n + 1 end end "
+        "function nice() for i = 1, 3 do coroutine.yield() end nice_n = n end");
+    assert(bOk);
+    auto hog = lua2.get_function_ref("hog");
+    auto nice = lua2.get_function_ref("nice");
+    sched.spawn(hog, 0);
+    sched.spawn(nice, 0);
+    sched.run();
+    assert(sched.task_count() == 0);
+    bOk = lua2.do_lua_string("assert(n == 1000000 and nice_n < n)");
+    assert(bOk);
+    lua2.release_function_ref(hog);
+    lua2.release_function_ref(nice);
+}
+
+//内存配额叠加在slab分配器上: 超出上限的脚本出错, 关闭后内存全部归还
+void TestLuaMemory()
+{
+    shr::lua_slab_allocator slab;
+    shr::lua_memory_quota quota(4 * 1024 * 1024, &shr::lua_slab_allocator::alloc, &slab);
+    shr::lua_state_wrapper lua;
+    bool bOk = lua.create(quota);
+    assert(bOk);
+    bOk = lua.do_lua_string(
+        "big = string.rep('x', 100000) "
+        "function grow() local t = {} for i = 1, 10000000 do t[i] = tostring(i) end end");
+    assert(bOk);
+    assert(slab.get_stats().m_nLargeCount > 0);
+
+    lua.call<>("grow");
+    std::string err = lua.get_error_msg();
+    assert(err.find("not enough memory") != std::string::npos);
+    assert(quota.get_failed_count() > 0 && quota.get_peak() <= quota.get_limit());
+
+    //出错后lua_State仍然可用
+    ::lua_gc(lua, LUA_GCCOLLECT, 0);
+    bOk = lua.do_lua_string("assert(#big == 100000)");
+    assert(bOk);
+
+    lua.close();
+    shr::lua_slab_allocator::stats stats = slab.get_stats();
+    assert(quota.get_used() == 0);
+    assert(stats.m_nLargeCount == 0 && stats.m_nLargeBytes == 0 && stats.m_nSmallBlockBytes == 0);
+
+    //上限太小, create失败而不是panic
+    shr::lua_memory_quota tiny(8 * 1024, &shr::lua_slab_allocator::alloc, &slab);
+    bOk = lua.create(tiny);
+    assert(!bOk);
+    stats = slab.get_stats();
+    assert(tiny.get_used() == 0 && stats.m_nLargeCount == 0 && stats.m_nSmallBlockBytes == 0);
+}
+
 int _tmain(int argc, _TCHAR* argv[])
 {
     std::locale::global(std::locale{ "" });
     TestLuaCpp();
+    TestLuaAsync();
+    TestLuaScheduler();
+    TestLuaRunBudget();
+    TestLuaMemory();
     return 0;
 }
 